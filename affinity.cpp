@@ -0,0 +1,74 @@
+#include "affinity.hpp"
+
+#include <charconv>
+
+#include <pthread.h>
+#include <sched.h>
+
+bool pin_current_thread(int cpu) {
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    return false;
+  }
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+bool pin_current_thread(std::span<const int> cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus) {
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+      return false;
+    }
+    CPU_SET(cpu, &set);
+  }
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+std::vector<int> current_thread_cpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    return cpus;
+  }
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+std::vector<int> parse_cpu_list(std::string_view list) {
+  std::vector<int> cpus;
+  const char *p = list.data();
+  const char *end = list.data() + list.size();
+  while (p != end) {
+    int first = 0;
+    auto result = std::from_chars(p, end, first);
+    if (result.ec != std::errc{}) {
+      return {};
+    }
+    p = result.ptr;
+    int last = first;
+    if (p != end && *p == '-') {
+      result = std::from_chars(p + 1, end, last);
+      if (result.ec != std::errc{} || last < first) {
+        return {};
+      }
+      p = result.ptr;
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    if (p != end) {
+      if (*p != ',' || p + 1 == end) {
+        return {};
+      }
+      p++;
+    }
+  }
+  return cpus;
+}
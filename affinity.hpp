@@ -0,0 +1,19 @@
+#pragma once
+
+#include <span>
+#include <string_view>
+#include <vector>
+
+// Pins the calling thread to one cpu, returning false if that failed.
+bool pin_current_thread(int cpu);
+
+// Lets the calling thread run on any of cpus, returning false if that
+// failed.
+bool pin_current_thread(std::span<const int> cpus);
+
+// The cpus the calling thread may run on.
+std::vector<int> current_thread_cpus();
+
+// Parses a cpu list such as "0,2,4-7". Returns an empty list if it is
+// malformed.
+std::vector<int> parse_cpu_list(std::string_view list);
@@ -0,0 +1,377 @@
+// In-process order book benchmark.
+//
+// Drives order_book::find_match and cancel_order directly, without sockets
+// and with event output discarded, so the numbers are matching cost alone.
+// Every book operation is timed individually; throughput is timed
+// operations over wall time, which for sweep includes rebuilding the book.
+// See usage() for the workloads.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+
+#include "clock.hpp"
+#include "histogram.hpp"
+#include "order_book.hpp"
+#include "output.hpp"
+
+namespace {
+
+constexpr uint32_t MID_PRICE = 100'000;
+
+struct bench_config {
+  unsigned threads = 1;
+  uint64_t ops = 1'000'000;
+  // 0 picks the workload's default
+  unsigned symbols = 0;
+  // resting orders per side for deep
+  unsigned depth = 10'000;
+  // resting orders taken out by each aggressive order for sweep
+  unsigned sweep = 50;
+  layout_policy layout = layout_policy::adaptive;
+};
+
+struct worker {
+  unsigned index;
+  std::mt19937_64 rng;
+  latency_histogram latency;
+  uint32_t next_id;
+  std::vector<owned_order> resting;
+  std::vector<instrument *> instruments;
+
+  explicit worker(unsigned index)
+      : index(index), rng(index + 1), next_id((index + 1) << 24) {}
+
+  uint32_t uniform(uint32_t lo, uint32_t hi) {
+    return std::uniform_int_distribution<uint32_t>(lo, hi)(rng);
+  }
+};
+
+uint64_t bench_symbol(unsigned i) {
+  // fits in SYMBOL_LENGTH below ten million symbols
+  char name[16];
+  snprintf(name, sizeof(name), "S%u", i);
+  return pack_symbol(name);
+}
+
+order_ref submit(order_book &book, instrument &instr, uint32_t id,
+                 order_type type, uint32_t price, uint32_t count) {
+  order *order = order_pool::instance().acquire();
+  order->reset(id, instr.symbol, price, count, type, 0);
+  order_ref ref{order, order->generation.load(std::memory_order_relaxed),
+                &instr};
+  book.find_match(instr, order);
+  return ref;
+}
+
+// Adds a non-crossing order somewhere in the first `levels` prices of its
+// side and remembers it for cancelling.
+void add_passive(order_book &book, worker &w, instrument &instr,
+                 uint32_t levels, bool timed) {
+  bool buy = w.uniform(0, 1);
+  uint32_t offset = w.uniform(1, levels);
+  uint32_t price = buy ? MID_PRICE - offset : MID_PRICE + offset;
+  uint32_t id = w.next_id++;
+  int64_t start = tsc_clock::now();
+  order_ref ref = submit(book, instr, id, buy ? BUY : SELL, price,
+                         w.uniform(1, 100));
+  if (timed) {
+    w.latency.record(tsc_clock::now() - start);
+  }
+  w.resting.push_back({id, ref});
+}
+
+// Cancels a random remembered order, returning it
+owned_order cancel_random(order_book &book, worker &w) {
+  size_t i = w.uniform(0, static_cast<uint32_t>(w.resting.size() - 1));
+  owned_order owned = w.resting[i];
+  w.resting[i] = w.resting.back();
+  w.resting.pop_back();
+  int64_t start = tsc_clock::now();
+  book.cancel_order(owned.id, owned.ref);
+  w.latency.record(tsc_clock::now() - start);
+  return owned;
+}
+
+constexpr uint32_t DEEP_LEVELS = 1000;
+constexpr uint32_t WIDE_LEVELS = 90'000;
+constexpr uint32_t CANCEL_LEVELS = 8;
+
+void preload(order_book &book, worker &w, const bench_config &config,
+             uint32_t levels) {
+  instrument &instr = *w.instruments[w.index % w.instruments.size()];
+  unsigned preload = 2 * config.depth / config.threads;
+  for (unsigned i = 0; i < preload; i++) {
+    add_passive(book, w, instr, levels, false);
+  }
+}
+
+void churn(order_book &book, worker &w, const bench_config &config,
+           uint32_t levels) {
+  instrument &instr = *w.instruments[w.index % w.instruments.size()];
+  for (uint64_t op = 0; op < config.ops; op += 2) {
+    add_passive(book, w, instr, levels, true);
+    cancel_random(book, w);
+  }
+}
+
+void prepare_deep(order_book &book, worker &w, const bench_config &config) {
+  preload(book, w, config, DEEP_LEVELS);
+}
+
+// Passive adds and cancels at random depth in a wide, deep book
+void run_deep(order_book &book, worker &w, const bench_config &config) {
+  churn(book, w, config, DEEP_LEVELS);
+}
+
+void prepare_wide(order_book &book, worker &w, const bench_config &config) {
+  preload(book, w, config, WIDE_LEVELS);
+}
+
+// The same over a price range far wider than a dense window, so most
+// levels hold a single order
+void run_wide(order_book &book, worker &w, const bench_config &config) {
+  churn(book, w, config, WIDE_LEVELS);
+}
+
+// Rebuilds `sweep` resting sells (untimed), then times one buy that takes
+// them all out
+void run_sweep(order_book &book, worker &w, const bench_config &config) {
+  instrument &instr = *w.instruments[w.index % w.instruments.size()];
+  constexpr uint32_t COUNT = 10;
+  for (uint64_t op = 0; op < config.ops; op++) {
+    for (uint32_t level = 1; level <= config.sweep; level++) {
+      submit(book, instr, w.next_id++, SELL, MID_PRICE + level, COUNT);
+    }
+    int64_t start = tsc_clock::now();
+    submit(book, instr, w.next_id++, BUY, MID_PRICE + config.sweep,
+           COUNT * config.sweep);
+    w.latency.record(tsc_clock::now() - start);
+  }
+}
+
+void prepare_cancel(order_book &book, worker &w, const bench_config &) {
+  instrument &instr = *w.instruments[w.index % w.instruments.size()];
+  for (unsigned i = 0; i < 512; i++) {
+    add_passive(book, w, instr, CANCEL_LEVELS, false);
+  }
+}
+
+// Long queues on a few levels near the top, one cancel for every add, and
+// one cancel in twenty for an order that is already gone
+void run_cancel(order_book &book, worker &w, const bench_config &config) {
+  instrument &instr = *w.instruments[w.index % w.instruments.size()];
+  std::vector<owned_order> gone;
+  for (uint64_t op = 0; op < config.ops; op += 2) {
+    add_passive(book, w, instr, CANCEL_LEVELS, true);
+    if (!gone.empty() && w.uniform(0, 19) == 0) {
+      owned_order owned = gone[w.uniform(0, gone.size() - 1)];
+      int64_t start = tsc_clock::now();
+      book.cancel_order(owned.id, owned.ref);
+      w.latency.record(tsc_clock::now() - start);
+      continue;
+    }
+    owned_order cancelled = cancel_random(book, w);
+    if (gone.size() < 1024) {
+      gone.push_back(cancelled);
+    }
+  }
+}
+
+// Crossing flow spread over many symbols, timing the symbol lookup too
+void run_symbols(order_book &book, worker &w, const bench_config &config) {
+  std::vector<uint64_t> symbols;
+  for (instrument *instr : w.instruments) {
+    symbols.push_back(instr->symbol);
+  }
+  for (uint64_t op = 0; op < config.ops; op++) {
+    uint64_t symbol = symbols[w.uniform(0, symbols.size() - 1)];
+    bool buy = w.uniform(0, 1);
+    uint32_t price = MID_PRICE + w.uniform(0, 10) - 5;
+    uint32_t count = w.uniform(1, 10);
+    int64_t start = tsc_clock::now();
+    instrument &instr = *book.resolve(symbol);
+    submit(book, instr, w.next_id++, buy ? BUY : SELL, price, count);
+    w.latency.record(tsc_clock::now() - start);
+  }
+}
+
+using workload_fn = void (*)(order_book &, worker &, const bench_config &);
+
+struct workload {
+  const char *name;
+  // untimed setup, run by each thread before the clock starts
+  workload_fn prepare;
+  workload_fn run;
+  unsigned default_symbols;
+};
+
+constexpr workload WORKLOADS[] = {
+    {"deep", prepare_deep, run_deep, 1},
+    {"wide", prepare_wide, run_wide, 1},
+    {"sweep", nullptr, run_sweep, 1},
+    {"cancel", prepare_cancel, run_cancel, 1},
+    {"symbols", nullptr, run_symbols, 10'000},
+};
+
+void run_workload(const workload &load, bench_config config) {
+  if (config.symbols == 0) {
+    config.symbols = load.default_symbols;
+  }
+  auto book = std::make_unique<order_book>();
+  book->set_layout_policy(config.layout);
+  std::vector<instrument *> instruments;
+  for (unsigned i = 0; i < config.symbols; i++) {
+    instruments.push_back(book->resolve(bench_symbol(i)));
+  }
+
+  std::vector<std::unique_ptr<worker>> workers;
+  for (unsigned i = 0; i < config.threads; i++) {
+    workers.push_back(std::make_unique<worker>(i));
+    workers.back()->instruments = instruments;
+  }
+
+  // start together so the threads actually contend
+  std::atomic<unsigned> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (auto &w : workers) {
+    threads.emplace_back([&, w = w.get()] {
+      if (load.prepare) {
+        load.prepare(*book, *w, config);
+      }
+      ready++;
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      load.run(*book, *w, config);
+    });
+  }
+  while (ready.load() != config.threads) {
+    std::this_thread::yield();
+  }
+  int64_t start = tsc_clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  double seconds = static_cast<double>(tsc_clock::now() - start) / 1e9;
+
+  latency_histogram total;
+  for (auto &w : workers) {
+    total.merge(w->latency);
+  }
+  printf("%-8s %7u %8u %10lu %10.3f %8lu %8lu %8lu %10lu\n", load.name,
+         config.threads, config.symbols, total.count(),
+         static_cast<double>(total.count()) / seconds / 1e6,
+         total.percentile(0.5), total.percentile(0.99),
+         total.percentile(0.999), total.max());
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [workload...]\n"
+          "Workloads (default: all):\n"
+          "  deep     passive adds and cancels at random depth in a wide book\n"
+          "  wide     the same over a price range of 90000 levels a side\n"
+          "  sweep    aggressive orders that each take out --sweep levels\n"
+          "  cancel   add/cancel churn on long queues near the top of book\n"
+          "  symbols  crossing flow spread over many symbols\n"
+          "Options:\n"
+          "  --threads <n>   threads driving the book (default 1)\n"
+          "  --ops <n>       timed operations per thread (default 1000000)\n"
+          "  --symbols <n>   symbols to spread over (default 1, 10000 for "
+          "symbols)\n"
+          "  --depth <n>     resting orders per side for deep (default "
+          "10000)\n"
+          "  --sweep <n>     levels per sweep (default 50)\n"
+          "  --layout <name> dense, sparse or adaptive (default) books\n",
+          prog);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  static const option long_options[] = {
+      {"threads", required_argument, nullptr, 't'},
+      {"ops", required_argument, nullptr, 'o'},
+      {"symbols", required_argument, nullptr, 's'},
+      {"depth", required_argument, nullptr, 'd'},
+      {"sweep", required_argument, nullptr, 'w'},
+      {"layout", required_argument, nullptr, 'l'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  bench_config config;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 't':
+      config.threads = std::max(1ul, strtoul(optarg, nullptr, 10));
+      break;
+    case 'o':
+      config.ops = strtoull(optarg, nullptr, 10);
+      break;
+    case 's':
+      config.symbols = strtoul(optarg, nullptr, 10);
+      break;
+    case 'd':
+      config.depth = strtoul(optarg, nullptr, 10);
+      break;
+    case 'w':
+      config.sweep = std::max(1ul, strtoul(optarg, nullptr, 10));
+      break;
+    case 'l':
+      if (optarg == std::string("dense")) {
+        config.layout = layout_policy::dense;
+      } else if (optarg == std::string("sparse")) {
+        config.layout = layout_policy::sparse;
+      } else if (optarg == std::string("adaptive")) {
+        config.layout = layout_policy::adaptive;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  std::vector<const workload *> selected;
+  for (int i = optind; i < argc; i++) {
+    auto found = std::find_if(std::begin(WORKLOADS), std::end(WORKLOADS),
+                              [&](const workload &load) {
+                                return argv[i] == std::string(load.name);
+                              });
+    if (found == std::end(WORKLOADS)) {
+      usage(argv[0]);
+      return 1;
+    }
+    selected.push_back(found);
+  }
+  if (selected.empty()) {
+    for (const workload &load : WORKLOADS) {
+      selected.push_back(&load);
+    }
+  }
+
+  tsc_clock::init();
+  event_writer::start(-1, output_format::discard);
+  printf("%-8s %7s %8s %10s %10s %8s %8s %8s %10s\n", "workload", "threads",
+         "symbols", "ops", "Mops/s", "p50(ns)", "p99(ns)", "p99.9", "max(ns)");
+  for (const workload *load : selected) {
+    run_workload(*load, config);
+  }
+  event_writer::stop();
+  return 0;
+}
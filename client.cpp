@@ -1,9 +1,14 @@
+#include <algorithm>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
 
+#include <fcntl.h>
+#include <getopt.h>
 #include <poll.h>
+#include <sched.h>
 #include <unistd.h>
 #include <pthread.h>
 
@@ -11,12 +16,20 @@
 #include <sys/socket.h>
 
 #include <atomic>
+#include <unordered_map>
+#include <vector>
 
+#include "histogram.hpp"
 #include "io.hpp"
+#include "output.hpp"
+#include "shm_ring.hpp"
 
 #define INPUT_CANCEL_ORDER 'C'
+#define INPUT_AMEND_ORDER 'A'
 #define INPUT_BUY_ORDER 'B'
 #define INPUT_SELL_ORDER 'S'
+#define INPUT_CANCEL_ALL 'M'
+#define INPUT_STATS 'T'
 
 static char* line_buffer;
 static size_t line_buffer_size = 0;
@@ -48,42 +61,505 @@ static void* poll_thread(void* fdptr)
 	return 0;
 }
 
-int main(int argc, char* argv[])
+// Parses one line of input into input. Returns 1 for a command, 0 for a
+// blank or comment line and -1 for an invalid line, which it reports.
+static int parse_command(const char* line, ClientCommand& input)
 {
-	if(argc < 2)
+	switch(line[0])
 	{
-		fprintf(stderr, "Usage: %s <path of socket to connect to> < <input>\n", argv[0]);
-		return 1;
+		case '#':
+		case '\n': return 0;
+		case INPUT_CANCEL_ORDER:
+			input.type = input_cancel;
+			if(sscanf(line + 1, " %u", &input.order_id) != 1)
+			{
+				fprintf(stderr, "Invalid cancel order: %s\n", line);
+				return -1;
+			}
+			return 1;
+		case INPUT_AMEND_ORDER:
+			input.type = input_amend;
+			if(sscanf(line + 1, " %u %u %u", &input.order_id, &input.price, &input.count) != 3)
+			{
+				fprintf(stderr, "Invalid amend order: %s\n", line);
+				return -1;
+			}
+			return 1;
+		case INPUT_CANCEL_ALL: input.type = input_cancel_all; return 1;
+		case INPUT_STATS: input.type = input_stats; return 1;
+		case INPUT_BUY_ORDER: input.type = input_buy; break;
+		case INPUT_SELL_ORDER: input.type = input_sell; break;
+		default: fprintf(stderr, "Invalid command '%c'\n", line[0]); return -1;
+	}
+
+	// optional trailing IOC, FOK or MKT
+	char kind[4] = "";
+	int fields = sscanf(line + 1, " %u %8s %u %u %3s", &input.order_id, input.instrument, &input.price, &input.count, kind);
+	if(fields == 5 && strcmp(kind, "IOC") == 0)
+		input.kind = order_ioc;
+	else if(fields == 5 && strcmp(kind, "FOK") == 0)
+		input.kind = order_fok;
+	else if(fields == 5 && strcmp(kind, "MKT") == 0)
+		input.kind = order_market;
+	else if(fields != 4)
+	{
+		fprintf(stderr, "Invalid new order: %s\n", line);
+		return -1;
 	}
+	return 1;
+}
 
+// Connects to the engine, switching the connection to a ring if asked.
+// Returns the connection's stream, or NULL having reported why.
+static FILE* connect_engine(const char* path, bool use_ring, command_ring& ring)
+{
 	int clientfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if(clientfd == -1)
 	{
 		perror("socket");
-		return 1;
+		return NULL;
 	}
 
 	{
 		struct sockaddr_un sockaddr {};
 		sockaddr.sun_family = AF_UNIX;
-		strncpy(sockaddr.sun_path, argv[1], sizeof(sockaddr.sun_path) - 1);
+		strncpy(sockaddr.sun_path, path, sizeof(sockaddr.sun_path) - 1);
 		if(connect(clientfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
 		{
 			perror("connect");
-			return 1;
+			close(clientfd);
+			return NULL;
 		}
 	}
 
 	FILE* client = fdopen(clientfd, "r+");
 	setbuf(client, NULL);
 
+	if(use_ring)
+	{
+		ClientCommand handshake {};
+		handshake.type = input_ring;
+		if(fwrite(&handshake, 1, sizeof(handshake), client) != sizeof(handshake))
+		{
+			fprintf(stderr, "Failed to write command\n");
+			fclose(client);
+			return NULL;
+		}
+		int ringfd = receive_ring_fd(clientfd);
+		if(ringfd == -1 || !ring.attach(ringfd))
+		{
+			perror("ring");
+			fclose(client);
+			return NULL;
+		}
+	}
+
 	pthread_t poll_thread_handle;
 	if(pthread_create(&poll_thread_handle, NULL, poll_thread, (void*) (long) clientfd) < 0)
 	{
 		fprintf(stderr, "Failed to create poll thread\n");
+		fclose(client);
+		return NULL;
+	}
+	pthread_detach(poll_thread_handle);
+	return client;
+}
+
+static bool send_commands(FILE* client, command_ring& ring, bool use_ring, const ClientCommand* commands, size_t count)
+{
+	if(use_ring)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			// the engine is behind; the poll thread exits if it is gone
+			while(!ring.try_push(commands[i]))
+				sched_yield();
+		}
+		return true;
+	}
+
+	if(fwrite(commands, sizeof(ClientCommand), count, client) != count)
+	{
+		fprintf(stderr, "Failed to write command\n");
+		return false;
+	}
+	return true;
+}
+
+// Sends the header and commands in batch as one write, then empties it
+// down to the header again
+static bool send_batch(FILE* client, command_ring& ring, bool use_ring, std::vector<ClientCommand>& batch)
+{
+	batch[0].count = (uint32_t) (batch.size() - 1);
+	bool sent = send_commands(client, ring, use_ring, batch.data(), batch.size());
+	batch.resize(1);
+	return sent;
+}
+
+/*
+ * Load generator mode (--load).
+ *
+ * The whole of stdin is parsed up front into one array of commands per
+ * connection, so sending is nothing but writes of many commands at a time.
+ * Orders, cancels and amends go to the connection numbered order id modulo
+ * the connection count, which keeps each order's cancels and amends behind
+ * it; a mass cancel goes to every connection. Each connection has its own
+ * sending thread, paced to its share of --rate or flat out.
+ *
+ * With --acks, the engine's event output (text or binary, written with
+ * --output-file) is read back afterwards and the first event naming each
+ * new order is taken as its acknowledgement. The engine stamps events on
+ * the CLOCK_MONOTONIC timeline, so its timestamps compare directly with the
+ * send times recorded here. When pacing, a command's send time is the time
+ * it was scheduled for, so an engine that stalls the sender is still
+ * charged for the wait.
+ */
+
+// stop waiting for acknowledgements once the event file stops growing
+#define ACK_IDLE_NS 1000000000LL
+
+struct load_connection
+{
+	FILE* client = NULL;
+	command_ring ring;
+	std::vector<ClientCommand> commands;
+	// when each command was (or was due to be) sent
+	std::vector<int64_t> sent_at;
+	size_t sent = 0;
+	bool failed = false;
+};
+
+static bool load_use_ring = false;
+static size_t load_write_size = 256;
+// commands per second per connection, 0 for flat out
+static double load_rate = 0;
+
+static int64_t monotonic_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void* load_thread(void* connptr)
+{
+	load_connection* conn = (load_connection*) connptr;
+	size_t total = conn->commands.size();
+	conn->sent_at.resize(total);
+	int64_t start = monotonic_ns();
+
+	while(conn->sent < total)
+	{
+		size_t n = std::min(load_write_size, total - conn->sent);
+		int64_t now = monotonic_ns();
+		if(load_rate > 0)
+		{
+			// command i is due i / load_rate seconds after the start
+			size_t due = (size_t) ((double) (now - start) * load_rate / 1e9) + 1;
+			if(due <= conn->sent)
+			{
+				int64_t next = start + (int64_t) ((double) conn->sent * 1e9 / load_rate);
+				struct timespec ts = { (time_t) (next / 1000000000), (long) (next % 1000000000) };
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+				continue;
+			}
+			n = std::min(n, due - conn->sent);
+			for(size_t i = conn->sent; i < conn->sent + n; i++)
+				conn->sent_at[i] = start + (int64_t) ((double) i * 1e9 / load_rate);
+		}
+		else
+		{
+			std::fill_n(conn->sent_at.begin() + (ptrdiff_t) conn->sent, n, now);
+		}
+
+		if(!send_commands(conn->client, conn->ring, load_use_ring, &conn->commands[conn->sent], n))
+		{
+			conn->failed = true;
+			break;
+		}
+		conn->sent += n;
+	}
+	return 0;
+}
+
+// Order ids waiting for their first event, with when they were sent
+typedef std::unordered_map<uint32_t, int64_t> pending_acks;
+
+static void acknowledged(pending_acks& pending, latency_histogram& latency, uint32_t id, int64_t timestamp)
+{
+	auto search = pending.find(id);
+	if(search == pending.end())
+		return;
+	latency.record((uint64_t) std::max<int64_t>(timestamp - search->second, 0));
+	pending.erase(search);
+}
+
+// Handles the whole text lines in [begin, end), returning where the
+// unfinished last line starts
+static const char* text_acks(const char* begin, const char* end, pending_acks& pending, latency_histogram& latency)
+{
+	while(true)
+	{
+		const char* newline = (const char*) memchr(begin, '\n', (size_t) (end - begin));
+		if(!newline)
+			return begin;
+
+		// the order named is the second field, or the third for an execution
+		const char* field = begin;
+		int skip = begin[0] == 'E' ? 2 : 1;
+		for(int i = 0; i < skip && field; i++)
+		{
+			field = (const char*) memchr(field, ' ', (size_t) (newline - field));
+			if(field)
+				field++;
+		}
+		const char* last = newline;
+		while(last > begin && last[-1] != ' ')
+			last--;
+		if(field && last > begin)
+			acknowledged(pending, latency, (uint32_t) strtoul(field, NULL, 10), strtoll(last, NULL, 10));
+		begin = newline + 1;
+	}
+}
+
+// Handles the whole binary records in [begin, end), returning where the
+// unfinished last record starts
+static const char* binary_acks(const char* begin, const char* end, pending_acks& pending, latency_histogram& latency)
+{
+	while(begin < end)
+	{
+		size_t size = binary_record_size((uint8_t) begin[0]);
+		if(size == 0 || (size_t) (end - begin) < size)
+			break;
+		output_event e = decode_event(begin);
+		acknowledged(pending, latency, e.kind == event_kind::executed ? e.other_id : e.id, e.timestamp);
+		begin += size;
+	}
+	return begin;
+}
+
+// Reads the engine's events from path until every pending order has been
+// seen or the file has stopped growing
+static bool collect_acks(const char* path, pending_acks& pending, latency_histogram& latency)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+	{
+		perror("open acks");
+		return false;
+	}
+
+	std::vector<char> buffer(1 << 20);
+	size_t used = 0;
+	int binary = -1;
+	int64_t last_data = monotonic_ns();
+	while(!pending.empty())
+	{
+		ssize_t n = read(fd, buffer.data() + used, buffer.size() - used);
+		if(n == -1)
+		{
+			perror("read acks");
+			close(fd);
+			return false;
+		}
+		if(n == 0)
+		{
+			if(monotonic_ns() - last_data > ACK_IDLE_NS)
+				break;
+			usleep(10000);
+			continue;
+		}
+		last_data = monotonic_ns();
+		used += (size_t) n;
+
+		const char* begin = buffer.data();
+		if(binary == -1)
+		{
+			if(used < sizeof(BINARY_MAGIC))
+				continue;
+			binary = memcmp(begin, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0;
+			if(binary)
+				begin += sizeof(BINARY_MAGIC);
+		}
+		const char* end = buffer.data() + used;
+		const char* rest = binary ? binary_acks(begin, end, pending, latency) : text_acks(begin, end, pending, latency);
+		used = (size_t) (end - rest);
+		memmove(buffer.data(), rest, used);
+	}
+	close(fd);
+	return true;
+}
+
+static int run_load(const char* path, unsigned connections, size_t batch_size, const char* acks_path)
+{
+	std::vector<load_connection> conns(connections);
+	size_t total = 0;
+	while(getline(&line_buffer, &line_buffer_size, stdin) != -1)
+	{
+		ClientCommand input {};
+		int parsed = parse_command(line_buffer, input);
+		if(parsed == -1)
+			return 1;
+		if(parsed == 0)
+			continue;
+		total++;
+		if(input.type == input_cancel_all)
+		{
+			for(load_connection& conn : conns)
+				conn.commands.push_back(input);
+			continue;
+		}
+		conns[input.type == input_stats ? 0 : input.order_id % connections].commands.push_back(input);
+	}
+
+	if(batch_size > 0)
+	{
+		// frame each connection's commands into batches of batch_size
+		for(load_connection& conn : conns)
+		{
+			std::vector<ClientCommand> framed;
+			for(size_t i = 0; i < conn.commands.size(); i += batch_size)
+			{
+				ClientCommand header {};
+				header.type = input_batch;
+				header.count = (uint32_t) std::min(batch_size, conn.commands.size() - i);
+				framed.push_back(header);
+				framed.insert(framed.end(), conn.commands.begin() + (ptrdiff_t) i, conn.commands.begin() + (ptrdiff_t) (i + header.count));
+			}
+			conn.commands.swap(framed);
+		}
+	}
+
+	for(load_connection& conn : conns)
+	{
+		conn.client = connect_engine(path, load_use_ring, conn.ring);
+		if(!conn.client)
+			return 1;
+	}
+
+	std::vector<pthread_t> threads(connections);
+	int64_t start = monotonic_ns();
+	for(unsigned i = 0; i < connections; i++)
+	{
+		if(pthread_create(&threads[i], NULL, load_thread, &conns[i]) != 0)
+		{
+			fprintf(stderr, "Failed to create load thread\n");
+			return 1;
+		}
+	}
+	bool failed = false;
+	size_t sent = 0;
+	for(unsigned i = 0; i < connections; i++)
+	{
+		pthread_join(threads[i], NULL);
+		failed |= conns[i].failed;
+		sent += conns[i].sent;
+	}
+	int64_t elapsed = monotonic_ns() - start;
+
+	main_is_exiting = 1;
+	for(load_connection& conn : conns)
+	{
+		if(load_use_ring)
+			conn.ring.close();
+		fclose(conn.client);
+	}
+
+	double seconds = (double) elapsed / 1e9;
+	fprintf(stderr, "sent %zu commands (%zu parsed) on %u connections in %.3f s, %.0f commands/s\n", sent, total, connections,
+	    seconds, seconds > 0 ? (double) sent / seconds : 0.0);
+
+	if(acks_path)
+	{
+		pending_acks pending;
+		for(load_connection& conn : conns)
+		{
+			for(size_t i = 0; i < conn.sent; i++)
+			{
+				const ClientCommand& command = conn.commands[i];
+				if(command.type == input_buy || command.type == input_sell)
+					pending.emplace(command.order_id, conn.sent_at[i]);
+			}
+		}
+		size_t orders = pending.size();
+		latency_histogram latency;
+		if(!collect_acks(acks_path, pending, latency))
+			return 1;
+		fprintf(stderr, "acknowledged %zu of %zu orders\n", orders - pending.size(), orders);
+		fprintf(stderr, "ack latency us: min %.1f p50 %.1f p90 %.1f p99 %.1f p99.9 %.1f p99.99 %.1f max %.1f\n",
+		    (double) latency.min() / 1e3, (double) latency.percentile(0.5) / 1e3, (double) latency.percentile(0.9) / 1e3,
+		    (double) latency.percentile(0.99) / 1e3, (double) latency.percentile(0.999) / 1e3,
+		    (double) latency.percentile(0.9999) / 1e3, (double) latency.max() / 1e3);
+	}
+
+	return failed || ferror(stderr) ? 1 : 0;
+}
+
+int main(int argc, char* argv[])
+{
+	static const struct option long_options[] = {
+		{ "shm", no_argument, NULL, 'm' },
+		{ "batch", required_argument, NULL, 'b' },
+		{ "load", no_argument, NULL, 'l' },
+		{ "connections", required_argument, NULL, 'c' },
+		{ "rate", required_argument, NULL, 'r' },
+		{ "write-size", required_argument, NULL, 'w' },
+		{ "acks", required_argument, NULL, 'a' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	bool use_ring = false;
+	size_t batch_size = 0;
+	bool load = false;
+	unsigned connections = 1;
+	double rate = 0;
+	const char* acks_path = NULL;
+	int opt;
+	while((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'm': use_ring = true; break;
+			case 'b': batch_size = strtoul(optarg, NULL, 10); break;
+			case 'l': load = true; break;
+			case 'c': connections = (unsigned) strtoul(optarg, NULL, 10); break;
+			case 'r': rate = strtod(optarg, NULL); break;
+			case 'w': load_write_size = strtoul(optarg, NULL, 10); break;
+			case 'a': acks_path = optarg; break;
+			default: optind = argc; break;
+		}
+	}
+
+	if(optind >= argc || connections == 0 || load_write_size == 0)
+	{
+		fprintf(stderr, "Usage: %s [options] <path of socket to connect to> < <input>\n", argv[0]);
+		fprintf(stderr, "  --shm               send commands through a shared-memory ring instead of the socket\n");
+		fprintf(stderr, "  --batch <n>         send every n commands as one framed batch, the rest at end of input\n");
+		fprintf(stderr, "  --load              load generator: parse all of the input first, then send it as fast as allowed\n");
+		fprintf(stderr, "  --connections <n>   with --load, spread the orders over n connections (default 1)\n");
+		fprintf(stderr, "  --rate <n>          with --load, send n commands a second in total (default: flat out)\n");
+		fprintf(stderr, "  --write-size <n>    with --load, send at most n commands per write (default 256)\n");
+		fprintf(stderr, "  --acks <path>       with --load, read the engine's event output from path and report\n"
+		                "                      order acknowledgement latency\n");
 		return 1;
 	}
 
+	if(load)
+	{
+		load_use_ring = use_ring;
+		load_rate = rate / connections;
+		return run_load(argv[optind], connections, batch_size, acks_path);
+	}
+
+	command_ring ring;
+	FILE* client = connect_engine(argv[optind], use_ring, ring);
+	if(!client)
+		return 1;
+
+	// a batch header followed by the commands so far
+	std::vector<ClientCommand> batch(1);
+	batch[0].type = input_batch;
+
 	while(1)
 	{
 		ClientCommand input {};
@@ -92,38 +568,28 @@ int main(int argc, char* argv[])
 		if(line_length == -1)
 			break;
 
-		switch(line_buffer[0])
-		{
-			case '#':
-			case '\n': continue;
-			case INPUT_CANCEL_ORDER:
-				input.type = input_cancel;
-				if(sscanf(line_buffer + 1, " %u", &input.order_id) != 1)
-				{
-					fprintf(stderr, "Invalid cancel order: %s\n", line_buffer);
-					return 1;
-				}
-				break;
-			case INPUT_BUY_ORDER: input.type = input_buy; goto new_order;
-			case INPUT_SELL_ORDER:
-				input.type = input_sell;
-			new_order:
-				if(sscanf(line_buffer + 1, " %u %8s %u %u", &input.order_id, input.instrument, &input.price, &input.count) != 4)
-				{
-					fprintf(stderr, "Invalid new order: %s\n", line_buffer);
-					return 1;
-				}
-				break;
-			default: fprintf(stderr, "Invalid command '%c'\n", line_buffer[0]); return 1;
-		}
+		int parsed = parse_command(line_buffer, input);
+		if(parsed == -1)
+			return 1;
+		if(parsed == 0)
+			continue;
 
-		if(fwrite(&input, 1, sizeof(input), client) != sizeof(input))
+		if(batch_size > 0)
 		{
-			fprintf(stderr, "Failed to write command\n");
-			return 1;
+			batch.push_back(input);
+			if(batch.size() - 1 == batch_size && !send_batch(client, ring, use_ring, batch))
+				return 1;
+			continue;
 		}
+
+		if(!send_commands(client, ring, use_ring, &input, 1))
+			return 1;
 	}
 
+	if(batch.size() > 1 && !send_batch(client, ring, use_ring, batch))
+		return 1;
+	if(use_ring)
+		ring.close();
 	main_is_exiting = 1;
 	fclose(client);
 
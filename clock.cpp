@@ -0,0 +1,138 @@
+#include "clock.hpp"
+
+#include <algorithm>
+#include <thread>
+
+#ifdef ENGINE_HAVE_TSC
+#include <cpuid.h>
+#endif
+
+namespace {
+
+// re-sync roughly this often
+constexpr double RESYNC_NS = 1e9;
+// how far a re-sync may steer the slope away from the measured rate
+constexpr double MAX_SKEW = 500e-6;
+
+// first calibration sample; later rates are measured from here
+uint64_t anchor_tsc;
+int64_t anchor_ns;
+double resync_ticks;
+
+#ifdef ENGINE_HAVE_TSC
+bool invariant_tsc() {
+  unsigned eax, ebx, ecx, edx;
+  if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+    return false;
+  }
+  __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+  return edx & (1u << 8);
+}
+
+// A TSC reading and a CLOCK_MONOTONIC reading taken as close together as we
+// can manage: the tightest of a few tries, with the TSC at its midpoint.
+void sample(uint64_t &tsc, int64_t &ns) {
+  uint64_t best = UINT64_MAX;
+  for (int i = 0; i < 5; i++) {
+    uint64_t before = __rdtsc();
+    int64_t mono = tsc_clock::monotonic_ns();
+    uint64_t after = __rdtsc();
+    if (after - before < best) {
+      best = after - before;
+      tsc = before + (after - before) / 2;
+      ns = mono;
+    }
+  }
+}
+#endif
+
+} // namespace
+
+void tsc_clock::init() {
+#ifdef ENGINE_HAVE_TSC
+  if (!invariant_tsc()) {
+    return;
+  }
+  uint64_t tsc0 = 0, tsc1 = 0;
+  int64_t ns0 = 0, ns1 = 0;
+  sample(tsc0, ns0);
+  timespec pause{0, 20'000'000};
+  while (nanosleep(&pause, &pause) != 0) {
+  }
+  sample(tsc1, ns1);
+  if (tsc1 <= tsc0 || ns1 <= ns0) {
+    return;
+  }
+  double rate =
+      static_cast<double>(ns1 - ns0) / static_cast<double>(tsc1 - tsc0);
+  // anything outside 10 MHz to 100 GHz means the TSC is not usable here
+  if (rate < 0.01 || rate > 100) {
+    return;
+  }
+
+  anchor_tsc = tsc0;
+  anchor_ns = ns0;
+  resync_ticks = RESYNC_NS / rate;
+  base_tsc.store(tsc1, std::memory_order_relaxed);
+  base_ns.store(ns1, std::memory_order_relaxed);
+  mult.store(static_cast<uint64_t>(rate * (1ull << SHIFT)),
+             std::memory_order_relaxed);
+  active.store(true, std::memory_order_release);
+#endif
+}
+
+void tsc_clock::start_resync() {
+  if (!enabled()) {
+    return;
+  }
+  std::thread([] {
+    timespec period{static_cast<time_t>(RESYNC_NS / 1e9),
+                    static_cast<long>(RESYNC_NS) % 1'000'000'000};
+    while (true) {
+      timespec left = period;
+      while (nanosleep(&left, &left) != 0) {
+      }
+      resync();
+    }
+  }).detach();
+}
+
+// Only ever run on the re-sync thread, so never concurrently with itself
+void tsc_clock::resync() noexcept {
+#ifdef ENGINE_HAVE_TSC
+  uint64_t sample_tsc = 0;
+  int64_t sample_ns = 0;
+  sample(sample_tsc, sample_ns);
+  double rate = static_cast<double>(sample_ns - anchor_ns) /
+                static_cast<double>(sample_tsc - anchor_tsc);
+
+  uint32_t s = seq.load(std::memory_order_relaxed);
+  seq.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  // Readers that got the old parameters read the TSC before this, so
+  // continuing the old line from here keeps the clock monotonic.
+  uint64_t tsc = __rdtsc();
+  uint64_t old_base = base_tsc.load(std::memory_order_relaxed);
+  uint64_t delta = tsc > old_base ? tsc - old_base : 0;
+  __extension__ using u128 = unsigned __int128;
+  int64_t estimate =
+      base_ns.load(std::memory_order_relaxed) +
+      static_cast<int64_t>((static_cast<u128>(delta) *
+                            mult.load(std::memory_order_relaxed)) >>
+                           SHIFT);
+  int64_t monotonic =
+      sample_ns +
+      static_cast<int64_t>(static_cast<double>(tsc - sample_tsc) * rate);
+  // close the gap to CLOCK_MONOTONIC over the next period
+  double slope =
+      rate + static_cast<double>(monotonic - estimate) / resync_ticks;
+  slope = std::clamp(slope, rate * (1 - MAX_SKEW), rate * (1 + MAX_SKEW));
+
+  base_tsc.store(tsc, std::memory_order_relaxed);
+  base_ns.store(estimate, std::memory_order_relaxed);
+  mult.store(static_cast<uint64_t>(slope * (1ull << SHIFT)),
+             std::memory_order_relaxed);
+  seq.store(s + 2, std::memory_order_release);
+#endif
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <ctime>
+
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#define ENGINE_HAVE_TSC 1
+#endif
+
+// Monotonic nanosecond clock.
+//
+// Reads the invariant TSC and scales it to CLOCK_MONOTONIC nanoseconds, so a
+// timestamp costs a few cycles instead of a clock_gettime call. init()
+// calibrates the scale; a thread started by start_resync() re-syncs it
+// against CLOCK_MONOTONIC about once a second, steering the slope rather
+// than stepping so readings never go backwards. now() only ever reads, so
+// no caller pays for a re-sync. Without an invariant TSC, or before init(),
+// it reads CLOCK_MONOTONIC directly.
+class tsc_clock {
+public:
+  // Calibrates the TSC, taking a few tens of milliseconds. Call once at
+  // startup, before other threads read the clock.
+  static void init();
+  // Starts the re-sync thread, which inherits the caller's cpu affinity.
+  // Without it the clock keeps its initial slope, which is fine for runs
+  // of a few seconds.
+  static void start_resync();
+  static bool enabled() { return active.load(std::memory_order_relaxed); }
+  static int64_t now() noexcept;
+
+  static int64_t monotonic_ns() noexcept {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1'000'000'000 + ts.tv_nsec;
+  }
+
+private:
+  // ns = base_ns + ((tsc - base_tsc) * mult) >> SHIFT
+  static constexpr unsigned SHIFT = 32;
+
+  static inline std::atomic<bool> active = false;
+  // seqlock over the fields below, odd while they are being rewritten
+  static inline std::atomic<uint32_t> seq = 0;
+  static inline std::atomic<uint64_t> base_tsc = 0;
+  static inline std::atomic<int64_t> base_ns = 0;
+  static inline std::atomic<uint64_t> mult = 0;
+
+  static void resync() noexcept;
+};
+
+inline int64_t tsc_clock::now() noexcept {
+#ifdef ENGINE_HAVE_TSC
+  if (active.load(std::memory_order_relaxed)) {
+    while (true) {
+      uint32_t s = seq.load(std::memory_order_acquire);
+      uint64_t tsc = __rdtsc();
+      uint64_t base = base_tsc.load(std::memory_order_relaxed);
+      int64_t ns = base_ns.load(std::memory_order_relaxed);
+      uint64_t m = mult.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if ((s & 1) || seq.load(std::memory_order_relaxed) != s) {
+        continue;
+      }
+      // another core's TSC may trail the base by a few cycles
+      uint64_t delta = tsc > base ? tsc - base : 0;
+      __extension__ using u128 = unsigned __int128;
+      return ns + static_cast<int64_t>((static_cast<u128>(delta) * m) >> SHIFT);
+    }
+  }
+#endif
+  return monotonic_ns();
+}
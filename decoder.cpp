@@ -0,0 +1,82 @@
+// Converts the engine's --binary-output stream back into its text output.
+//
+//   ./engine --binary-output /tmp/sock | ./decoder
+//   ./decoder events.bin > events.txt
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "output.hpp"
+
+int main(int argc, char *argv[]) {
+  if (argc > 2) {
+    fprintf(stderr, "Usage: %s [binary event file]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *in = stdin;
+  if (argc == 2 && strcmp(argv[1], "-") != 0) {
+    in = fopen(argv[1], "rb");
+    if (!in) {
+      perror("fopen");
+      return 1;
+    }
+  }
+
+  char magic[sizeof(BINARY_MAGIC)];
+  if (fread(magic, 1, sizeof(magic), in) != sizeof(magic)) {
+    // the engine writes nothing at all until its first event
+    return feof(in) ? 0 : 1;
+  }
+  if (memcmp(magic, BINARY_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "Not an engine binary event stream\n");
+    return 1;
+  }
+
+  constexpr size_t BUFFER_SIZE = 1 << 16;
+  std::vector<char> input(BUFFER_SIZE);
+  std::vector<char> output(BUFFER_SIZE);
+  size_t start = 0;
+  size_t end = 0;
+  size_t used = 0;
+
+  while (true) {
+    // carry a partial record over to the front and top the buffer up
+    memmove(input.data(), input.data() + start, end - start);
+    end -= start;
+    start = 0;
+    size_t n = fread(input.data() + end, 1, BUFFER_SIZE - end, in);
+    end += n;
+
+    while (start < end) {
+      size_t size = binary_record_size(static_cast<uint8_t>(input[start]));
+      if (size == 0) {
+        fprintf(stderr, "Bad record kind %u\n",
+                static_cast<unsigned>(static_cast<uint8_t>(input[start])));
+        return 1;
+      }
+      if (end - start < size) {
+        break;
+      }
+      if (BUFFER_SIZE - used < MAX_EVENT_TEXT) {
+        fwrite(output.data(), 1, used, stdout);
+        used = 0;
+      }
+      used += format_event(output.data() + used,
+                           decode_event(input.data() + start));
+      start += size;
+    }
+
+    if (n == 0) {
+      break;
+    }
+  }
+
+  fwrite(output.data(), 1, used, stdout);
+  if (start != end) {
+    fprintf(stderr, "Truncated record at end of input\n");
+    return 1;
+  }
+  return ferror(in) || ferror(stdout) ? 1 : 0;
+}
@@ -1,62 +1,759 @@
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <csignal>
+#include <functional>
 #include <iostream>
-#include <memory>
+#include <sstream>
 #include <thread>
 
+#include <poll.h>
+#include <sys/epoll.h>
+
 #include "engine.hpp"
 #include "io.hpp"
 #include "order_book.hpp"
+#include "shm_ring.hpp"
+#include "stats.hpp"
 
 order_book order_book;
 
+Engine::Engine(engine_options options) : options(options) {
+  order_book.set_layout_policy(options.book_layout);
+  if (options.stats) {
+    stats::enable();
+  }
+  if (options.stats || options.snapshot_path) {
+    std::thread(&Engine::signal_thread, this).detach();
+  }
+
+  const execution_profile &profile = options.profile;
+  for (unsigned i = 0; i < options.shards; i++) {
+    std::vector<int> cpus = profile.other_cpus;
+    if (!profile.shard_cpus.empty()) {
+      cpus = {profile.shard_cpus[i % profile.shard_cpus.size()]};
+    }
+    shards.push_back(
+        std::make_unique<matching_shard>(order_book, options.journal, cpus));
+  }
+
+  if (options.workers == 0) {
+    return;
+  }
+  epollfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollfd == -1) {
+    perror("epoll_create1");
+    exit(1);
+  }
+  for (unsigned i = 0; i < options.workers; i++) {
+    workers.emplace_back(&Engine::worker_thread, this);
+  }
+}
+
 void Engine::accept(ClientConnection connection) {
-  auto thread =
-      std::thread(&Engine::connection_thread, this, std::move(connection));
-  thread.detach();
+  uint32_t id = next_connection.fetch_add(1, std::memory_order_relaxed);
+  if (options.workers == 0) {
+    auto thread = std::thread(&Engine::connection_thread, this,
+                              std::move(connection), id);
+    thread.detach();
+    return;
+  }
+
+  if (!connection.setNonBlocking()) {
+    perror("fcntl");
+    return;
+  }
+  auto *conn = new reactor_connection{std::move(connection), {}, {}};
+  conn->session.id = id;
+  // one-shot, so a connection is only ever served by one worker at a time
+  // and its commands are handled in order
+  epoll_event event{};
+  event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  event.data.ptr = conn;
+  if (epoll_ctl(epollfd, EPOLL_CTL_ADD, conn->connection.handle(), &event) ==
+      -1) {
+    perror("epoll_ctl");
+    delete conn;
+  }
 }
 
-void Engine::connection_thread(ClientConnection connection) {
+// Pins the calling connection, worker or ring thread as the profile says
+void Engine::pin_engine_thread() {
+  size_t index = next_engine_cpu.fetch_add(1, std::memory_order_relaxed);
+  if (!::pin_engine_thread(options.profile, options.profile.engine_cpus,
+                           index)) {
+    SyncCerr{} << "Could not pin engine thread" << std::endl;
+  }
+}
+
+void Engine::worker_thread() {
+  pin_engine_thread();
+  constexpr int MAX_EVENTS = 64;
+  epoll_event events[MAX_EVENTS];
+  adaptive_spin spinner(options.profile.spin_us);
+  while (true) {
+    int n = 0;
+    // with busy polling, look for ready connections without blocking
+    // for as long as the spinner allows, and only then sleep in the kernel
+    if (!options.profile.busy_poll || !spinner.spin([&] {
+          n = epoll_wait(epollfd, events, MAX_EVENTS, 0);
+          return n != 0;
+        })) {
+      n = epoll_wait(epollfd, events, MAX_EVENTS, -1);
+    }
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("epoll_wait");
+      return;
+    }
+    for (int i = 0; i < n; i++) {
+      auto *conn = static_cast<reactor_connection *>(events[i].data.ptr);
+      bool was_serving = conn->serving.exchange(true, std::memory_order_acquire);
+      assert(!was_serving);
+      (void)was_serving;
+      drain_result result = drain(*conn);
+      if (result == drain_result::detached) {
+        continue;
+      }
+      if (result == drain_result::closed) {
+        disconnected(conn->session);
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->connection.handle(), nullptr);
+        delete conn;
+        continue;
+      }
+      // another worker may own conn as soon as it is rearmed
+      int fd = conn->connection.handle();
+      conn->serving.store(false, std::memory_order_release);
+      epoll_event event{};
+      event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+      event.data.ptr = conn;
+      epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
+    }
+  }
+}
+
+// Handles what the client has sent. Stops after a bounded number of reads so
+// one busy client cannot hold a worker; the one-shot rearm brings it straight
+// back if more is pending. A client asking for a ring gets a thread of its
+// own to poll it, which takes over the connection.
+Engine::drain_result Engine::drain(reactor_connection &conn) {
+  constexpr int MAX_READS = 16;
+  for (int reads = 0; reads < MAX_READS; reads++) {
+    std::span<const ClientCommand> batch;
+    switch (conn.connection.readBatch(batch)) {
+    case ReadResult::Error:
+      SyncCerr{} << "Error reading input" << std::endl;
+      return drain_result::closed;
+    case ReadResult::EndOfFile:
+      return drain_result::closed;
+    case ReadResult::WouldBlock:
+      return drain_result::pending;
+    case ReadResult::Success:
+      break;
+    }
+
+    if (batch.front().type == input_ring) {
+      epoll_ctl(epollfd, EPOLL_CTL_DEL, conn.connection.handle(), nullptr);
+      std::thread([this, conn = &conn] {
+        pin_engine_thread();
+        serve_ring(conn->connection, conn->session);
+        delete conn;
+      }).detach();
+      return drain_result::detached;
+    }
+    dispatch(conn.session, batch);
+  }
+  return drain_result::pending;
+}
+
+void Engine::connection_thread(ClientConnection connection, uint32_t id) {
+  pin_engine_thread();
   // thread local
-  std::unordered_map<uint32_t, std::shared_ptr<order>> client_orders;
+  client_session session;
+  session.id = id;
+  // a socket left blocking never reports WouldBlock, so never spins
+  if (options.profile.busy_poll && !connection.setNonBlocking()) {
+    perror("fcntl");
+  }
+  adaptive_spin spinner(options.profile.spin_us);
   while (true) {
-    ClientCommand input{};
-    switch (connection.readInput(input)) {
+    // everything the client has sent so far, in one read
+    std::span<const ClientCommand> batch;
+    ReadResult result = connection.readBatch(batch);
+    if (result == ReadResult::WouldBlock &&
+        !spinner.spin([&] {
+          result = connection.readBatch(batch);
+          return result != ReadResult::WouldBlock;
+        })) {
+      // nothing came while spinning, block until something does
+      pollfd pfd{connection.handle(), POLLIN | POLLRDHUP, 0};
+      if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+        perror("poll");
+      }
+      continue;
+    }
+    switch (result) {
     case ReadResult::Error:
       SyncCerr{} << "Error reading input" << std::endl;
+      [[fallthrough]];
     case ReadResult::EndOfFile:
+      disconnected(session);
       return;
+    case ReadResult::WouldBlock:
+      // handled above
+      continue;
     case ReadResult::Success:
       break;
     }
 
-    switch (input.type) {
-    // Finally, order cancel requests can only come from the client that
-    // originally sent the order – that is, a client cannot cancel an order that
-    // did not originate from itself.
-    case input_cancel: {
-      auto search = client_orders.find(input.order_id);
-      if (search == client_orders.end()) {
-        // order not found
-        auto output_time = getCurrentTimestamp();
-        Output::OrderDeleted(input.order_id, false, output_time);
-        break;
+    if (batch.front().type == input_ring) {
+      serve_ring(connection, session);
+      return;
+    }
+    dispatch(session, batch);
+  }
+}
+
+// Hands the client a ring and handles what it writes there until it closes
+// the ring or its socket goes away.
+void Engine::serve_ring(ClientConnection &connection,
+                        client_session &session) {
+  command_ring ring;
+  if (!ring.create(RING_COMMANDS) ||
+      !send_ring_fd(connection.handle(), ring.fd())) {
+    SyncCerr{} << "Could not set up command ring: " << strerror(errno)
+               << std::endl;
+    disconnected(session);
+    return;
+  }
+
+  // how long to sleep between checks for a client that died without
+  // closing its ring
+  constexpr int LIVENESS_MS = 100;
+  bool gone = false;
+  while (true) {
+    // read before peeking, so nothing published before the close is missed
+    bool closing = gone || ring.closed();
+    // a copy, so the slots go back to the client before the work is done
+    std::span<const ClientCommand> batch = ring.peek();
+    if (!batch.empty()) {
+      ring.consume(batch.size());
+      dispatch(session, batch);
+      continue;
+    }
+    if (closing) {
+      break;
+    }
+    if (!ring.wait(LIVENESS_MS)) {
+      pollfd pfd{connection.handle(), POLLRDHUP, 0};
+      gone = poll(&pfd, 1, 0) > 0;
+    }
+  }
+  if (ring.overrun()) {
+    SyncCerr{} << "Client " << session.id
+               << " overran its command ring, disconnecting" << std::endl;
+  }
+  disconnected(session);
+}
+
+// Splits commands into single commands and framed batches. A batch may
+// arrive over several reads; it is then collected in the session first.
+void Engine::dispatch(client_session &session,
+                      std::span<const ClientCommand> commands) {
+  while (!commands.empty()) {
+    if (session.batch_remaining == 0) {
+      const ClientCommand &input = commands.front();
+      if (input.type == input_batch) {
+        session.batch_remaining = input.count;
+      } else {
+        handle_command(session, input);
       }
-      std::shared_ptr<order> order = search->second;
-      order_book.cancel_order(order);
+      commands = commands.subspan(1);
+      continue;
+    }
+
+    size_t n = std::min<size_t>(session.batch_remaining, commands.size());
+    session.batch_remaining -= n;
+    if (session.batch_remaining == 0 && session.batch.empty()) {
+      // all of it came in one read, run it in place
+      handle_batch(session, commands.first(n));
+    } else {
+      session.batch.insert(session.batch.end(), commands.begin(),
+                           commands.begin() + n);
+      if (session.batch_remaining == 0) {
+        handle_batch(session, session.batch);
+        session.batch.clear();
+      }
+    }
+    commands = commands.subspan(n);
+  }
+}
+
+void Engine::handle_command(client_session &session,
+                            const ClientCommand &input) {
+  switch (input.type) {
+  // Finally, order cancel requests can only come from the client that
+  // originally sent the order – that is, a client cannot cancel an order that
+  // did not originate from itself.
+  case input_cancel: {
+    auto search = find_order(session, input.order_id);
+    if (search == session.orders.end()) {
+      // order not found
+      reject(session, input);
+      break;
+    }
+    const order_ref &ref = search->second;
+    if (!shards.empty()) {
+      // same queue as the order itself, so it cannot overtake it
+      submit(session, shard_action::cancel, input, ref);
+      break;
+    }
+    auto lock = lock_instrument(*ref.instr);
+    journal(journal_entry::command, session, input);
+    order_book.cancel_order_unlocked(input.order_id, ref);
+    break;
+  }
+
+  // Amends keep the order's session entry and pooled order; only the book
+  // changes, under the same single lock a cancel takes.
+  case input_amend: {
+    auto search = find_order(session, input.order_id);
+    if (search == session.orders.end()) {
+      reject(session, input);
+      break;
+    }
+    const order_ref &ref = search->second;
+    if (!shards.empty()) {
+      submit(session, shard_action::amend, input, ref);
       break;
     }
+    auto lock = lock_instrument(*ref.instr);
+    journal(journal_entry::command, session, input);
+    order_book.amend_order_unlocked(input.order_id, ref, input.price,
+                                    input.count);
+    break;
+  }
+
+  case input_cancel_all:
+    cancel_all(session);
+    break;
+
+  case input_stats:
+    dump_stats();
+    break;
+
+  case input_ring:
+  case input_batch:
+    // only honoured by connection_thread and dispatch respectively
+    break;
+
+  case input_buy:
+  case input_sell: {
+    order_ref ref = new_order(session, input);
+    if (!shards.empty()) {
+      submit(session, shard_action::match, input, ref);
+      break;
+    }
+    auto lock = lock_instrument(*ref.instr);
+    journal(journal_entry::command, session, input);
+    order_book.find_match_unlocked(*ref.instr, ref.ptr);
+    break;
+  }
+  }
+}
 
+// Queues an order, cancel or amend on the shard that owns its instrument
+void Engine::submit(client_session &session, shard_action action,
+                    const ClientCommand &input, const order_ref &ref) {
+  size_t shard = shard_of(*ref.instr, shards.size());
+  session.shards_used.resize(shards.size());
+  session.shards_used[shard] = true;
+  shard_command command{action, input.order_id, ref};
+  command.input = input;
+  command.connection = session.id;
+  shards[shard]->submit(command);
+}
+
+// Journals input, if journaling. Unsharded, this is called holding the
+// instrument lock, just before the command takes effect; shards journal
+// their own commands.
+void Engine::journal(journal_entry kind, const client_session &session,
+                     const ClientCommand &input) {
+  if (options.journal) {
+    options.journal->append(kind, session.id, getCurrentTimestamp(), input);
+  }
+}
+
+// Sets up a new order and records it in the session, ready to match
+order_ref Engine::new_order(client_session &session,
+                            const ClientCommand &input) {
+  auto order_type = input.type == input_sell ? SELL : BUY;
+  auto timestamp = static_cast<uintmax_t>(getCurrentTimestamp());
+  stats::count(counter::orders);
+  instrument *instr;
+  {
+    stage_timer timer(stage::lookup);
+    uint64_t symbol = pack_symbol(input.instrument);
+    instrument *&cached = session.instruments[symbol];
+    if (!cached) {
+      cached = order_book.resolve(symbol);
+    }
+    instr = cached;
+  }
+  session.last_instrument = instr;
+  uint32_t price = input.price;
+  auto tif = time_in_force::good_till_cancel;
+  switch (input.kind) {
+  case order_limit:
+    break;
+  case order_ioc:
+    tif = time_in_force::immediate_or_cancel;
+    break;
+  case order_fok:
+    tif = time_in_force::fill_or_kill;
+    break;
+  case order_market:
+    // a limit no resting order can fail
+    price = order_type == BUY ? UINT32_MAX : 0;
+    tif = time_in_force::immediate_or_cancel;
+    break;
+  }
+  order *order = order_pool::instance().acquire();
+  order->reset(input.order_id, instr->symbol, price, input.count, order_type,
+               timestamp, tif);
+  // capture the generation first, the order may be released while matching
+  order_ref ref{order, order->generation.load(std::memory_order_relaxed),
+                instr};
+  session.orders[input.order_id] = ref;
+  session.by_instrument[instr].push_back({input.order_id, ref});
+  if (session.orders.size() >= session.prune_at) {
+    prune_orders(session);
+  }
+  return ref;
+}
+
+// The client's order with this id, or a restored one it now takes over,
+// or session.orders.end() if there is neither.
+std::unordered_map<uint32_t, order_ref>::iterator
+Engine::find_order(client_session &session, uint32_t order_id) {
+  auto search = session.orders.find(order_id);
+  if (search != session.orders.end() ||
+      !any_restored.load(std::memory_order_acquire)) {
+    return search;
+  }
+  std::lock_guard<std::mutex> lock(restored_mtx);
+  auto found = restored.find(order_id);
+  if (found == restored.end()) {
+    return search;
+  }
+  order_ref ref = found->second;
+  restored.erase(found);
+  if (restored.empty()) {
+    any_restored.store(false, std::memory_order_relaxed);
+  }
+  session.instruments[ref.instr->symbol] = ref.instr;
+  session.last_instrument = ref.instr;
+  session.by_instrument[ref.instr].push_back({order_id, ref});
+  return session.orders.emplace(order_id, ref).first;
+}
+
+// Forgets orders that have been filled or cancelled. A released order's
+// generation only ever moves on, so this needs no instrument lock; an order
+// that leaves the book just after being checked is caught at the next
+// prune, and a cancel or mass cancel of it is still checked under the lock.
+// A cancel of a forgotten id is rejected exactly as one of a dead ref is.
+void Engine::prune_orders(client_session &session) {
+  std::erase_if(session.orders,
+                [](const auto &entry) { return !entry.second.live(); });
+  for (auto it = session.by_instrument.begin();
+       it != session.by_instrument.end();) {
+    std::erase_if(it->second,
+                  [](const owned_order &owned) { return !owned.ref.live(); });
+    it = it->second.empty() ? session.by_instrument.erase(it) : std::next(it);
+  }
+  session.prune_at =
+      std::max(client_session::MIN_PRUNE_AT, 2 * session.orders.size());
+}
+
+// Runs a framed batch taking each instrument lock once. Orders, cancels and
+// amends are grouped by instrument, keeping their order within each
+// instrument; any other command first runs what has been grouped so far.
+// Shards take no locks, so there the commands just go to their shards one by
+// one.
+void Engine::handle_batch(client_session &session,
+                          std::span<const ClientCommand> commands) {
+  if (!shards.empty()) {
+    for (const ClientCommand &input : commands) {
+      handle_command(session, input);
+    }
+    return;
+  }
+
+  for (uint32_t position = 0; position < commands.size(); position++) {
+    const ClientCommand &input = commands[position];
+    book_op op;
+    switch (input.type) {
     case input_buy:
-    case input_sell: {
-      auto order_type = input.type == input_sell ? SELL : BUY;
-      auto timestamp = static_cast<uintmax_t>(getCurrentTimestamp());
-      std::shared_ptr<order> ptr =
-          std::make_shared<order>(input.order_id, input.instrument, input.price,
-                                  input.count, order_type, timestamp);
-      client_orders[input.order_id] = ptr;
-      order_book.find_match(ptr);
+    case input_sell:
+      op = {book_action::match, input.order_id, new_order(session, input)};
+      break;
+    case input_cancel:
+    case input_amend: {
+      auto search = find_order(session, input.order_id);
+      if (search == session.orders.end()) {
+        // no earlier command can make this one succeed, but its reject
+        // must still come out after their events
+        flush_batch(session, commands);
+        handle_command(session, input);
+        continue;
+      }
+      if (input.type == input_cancel) {
+        op = {book_action::cancel, input.order_id, search->second};
+      } else {
+        op = {book_action::amend, input.order_id, search->second, input.price,
+              input.count};
+      }
       break;
     }
+    default:
+      flush_batch(session, commands);
+      handle_command(session, input);
+      continue;
     }
+    op.position = position;
+    session.batch_ops.push_back(op);
+  }
+  flush_batch(session, commands);
+}
+
+// Runs the grouped ops of the batch commands, journaling each as it runs
+void Engine::flush_batch(client_session &session,
+                         std::span<const ClientCommand> commands) {
+  std::vector<book_op> &ops = session.batch_ops;
+  std::stable_sort(ops.begin(), ops.end(),
+                   [](const book_op &a, const book_op &b) {
+                     return std::less<instrument *>{}(a.ref.instr,
+                                                      b.ref.instr);
+                   });
+  for (auto group = ops.begin(); group != ops.end();) {
+    instrument *instr = group->ref.instr;
+    auto end = std::find_if(group, ops.end(), [&](const book_op &op) {
+      return op.ref.instr != instr;
+    });
+    auto lock = lock_instrument(*instr);
+    if (!options.journal) {
+      order_book.run_batch_unlocked(*instr,
+                                    std::span<const book_op>(group, end));
+    } else {
+      for (; group != end; ++group) {
+        journal(journal_entry::command, session, commands[group->position]);
+        order_book.run_batch_unlocked(*instr, {&*group, 1});
+      }
+    }
+    group = end;
+  }
+  ops.clear();
+}
+
+// Reports a cancel or amend of an id the client has no order for. When
+// sharded, the client's earlier orders may still be queued, so the reject
+// goes through every shard the client has used, and the last one journals
+// and reports it. Otherwise, when journaling, it is journaled and reported
+// holding the lock of the instrument the client last sent an order to, so
+// it comes at the same point among that instrument's events when replayed.
+void Engine::reject(client_session &session, const ClientCommand &input) {
+  stats::count(counter::rejects);
+  uint32_t used = std::count(session.shards_used.begin(),
+                             session.shards_used.end(), true);
+  if (used == 0) {
+    std::unique_lock<std::mutex> lock;
+    if (options.journal) {
+      if (session.last_instrument) {
+        lock = lock_instrument(*session.last_instrument);
+      }
+      journal(journal_entry::reject, session, input);
+    }
+    Output::OrderDeleted(input.order_id, false, getCurrentTimestamp());
+    return;
+  }
+  auto *pending = new shard_reject(used);
+  for (size_t i = 0; i < session.shards_used.size(); i++) {
+    if (session.shards_used[i]) {
+      shard_command command{shard_action::reject, input.order_id, {}};
+      command.reject = pending;
+      command.input = input;
+      command.connection = session.id;
+      shards[i]->submit(command);
+    }
+  }
+}
+
+void Engine::cancel_all(client_session &session) {
+  stats::count(counter::mass_cancels);
+  // only what may still be resting goes to the book, so the instrument
+  // locks are held for the client's live orders alone
+  prune_orders(session);
+  for (auto &[instr, orders] : session.by_instrument) {
+    cancel_orders(session, *instr, orders);
+  }
+  // nothing the client sent before this can be cancelled any more
+  session.by_instrument.clear();
+  session.orders.clear();
+  session.prune_at = client_session::MIN_PRUNE_AT;
+}
+
+// Cancels orders, the session's on instr, and journals that as one record
+void Engine::cancel_orders(client_session &session, instrument &instr,
+                           std::vector<owned_order> &orders) {
+  if (!shards.empty()) {
+    // queued behind the client's earlier orders, so they are all in the
+    // book by the time the shard gets to this
+    shard_command command{shard_action::cancel_all, 0, {nullptr, 0, &instr}};
+    command.orders = new std::vector<owned_order>(std::move(orders));
+    command.connection = session.id;
+    shards[shard_of(instr, shards.size())]->submit(command);
+    return;
+  }
+  auto lock = lock_instrument(instr);
+  if (options.journal) {
+    options.journal->append_cancel_all(session.id, getCurrentTimestamp(),
+                                       instr.symbol);
+  }
+  order_book.cancel_all_unlocked(instr, orders);
+}
+
+void Engine::disconnected(client_session &session) {
+  if (options.cancel_on_disconnect) {
+    cancel_all(session);
+  }
+}
+
+sigset_t engine_signals(const engine_options &options) {
+  sigset_t set;
+  sigemptyset(&set);
+  if (options.stats) {
+    sigaddset(&set, SIGUSR1);
+  }
+  if (options.snapshot_path) {
+    sigaddset(&set, SIGUSR2);
+  }
+  return set;
+}
+
+void Engine::signal_thread() {
+  sigset_t set = engine_signals(options);
+  while (true) {
+    int signum;
+    if (sigwait(&set, &signum) != 0) {
+      continue;
+    }
+    if (signum == SIGUSR1) {
+      dump_stats();
+    } else if (signum == SIGUSR2 && !snapshot(options.snapshot_path)) {
+      SyncCerr{} << "Snapshot failed: " << strerror(errno) << std::endl;
+    }
+  }
+}
+
+void Engine::dump_stats() {
+  std::ostringstream os;
+  stats::dump(os);
+  if (stats::enabled()) {
+    order_book.print_resting(os, 20);
+  }
+  SyncCerr{} << os.str() << std::flush;
+}
+
+// Every record is applied on its own, batches included, in file order.
+// Mass cancels were journaled per instrument, as they reached each book, so
+// they are replayed that way too, and disconnects need no record: any
+// cancel-on-disconnect is in the journal as mass cancels.
+void Engine::replay(std::span<const journal_record> records) {
+  std::unordered_map<uint32_t, client_session> sessions;
+  for (const journal_record &record : records) {
+    client_session &session = sessions[record.connection];
+    session.id = record.connection;
+    switch (record.kind) {
+    case journal_entry::command:
+      handle_command(session, record.command);
+      break;
+    case journal_entry::reject:
+      reject(session, record.command);
+      break;
+    case journal_entry::cancel_all: {
+      instrument *instr =
+          order_book.resolve(pack_symbol(record.command.instrument));
+      auto found = session.by_instrument.find(instr);
+      if (found != session.by_instrument.end()) {
+        cancel_orders(session, *instr, found->second);
+        session.by_instrument.erase(found);
+      }
+      break;
+    }
+    }
+  }
+  for (auto &shard : shards) {
+    shard->drain();
+  }
+}
+
+bool Engine::snapshot(const char *path) {
+  std::vector<instrument *> instruments = order_book.all_instruments();
+  std::vector<snapshot_order> orders;
+  if (shards.empty()) {
+    for (instrument *instr : instruments) {
+      std::unique_lock<std::mutex> lock(instr->mtx);
+      order_book.snapshot_unlocked(*instr, orders);
+    }
+  } else {
+    // the shard is the only thread that may look at its books
+    for (size_t i = 0; i < shards.size(); i++) {
+      std::function<void()> task = [&] {
+        for (instrument *instr : instruments) {
+          if (shard_of(*instr, shards.size()) == i) {
+            order_book.snapshot_unlocked(*instr, orders);
+          }
+        }
+      };
+      shards[i]->call(task);
+    }
+  }
+  return write_snapshot(path, instruments.size(), orders);
+}
+
+bool Engine::restore(const char *path, size_t &orders, size_t &dropped) {
+  snapshot_reader reader;
+  if (!reader.open(path)) {
+    return false;
+  }
+  std::span<const snapshot_order> records = reader.orders();
+  std::unordered_map<uint32_t, uint32_t> uses;
+  for (const snapshot_order &record : records) {
+    uses[record.id]++;
+  }
+  // copy only when there is something to leave out, the usual snapshot is
+  // loaded straight from the mapping
+  std::vector<snapshot_order> unique;
+  if (uses.size() != records.size()) {
+    for (const snapshot_order &record : records) {
+      if (uses[record.id] == 1) {
+        unique.push_back(record);
+      }
+    }
+    records = unique;
+  }
+
+  std::vector<owned_order> orphans;
+  order_book.restore(records, orphans);
+  for (const owned_order &owned : orphans) {
+    restored.emplace(owned.id, owned.ref);
   }
+  any_restored.store(!restored.empty(), std::memory_order_release);
+  orders = records.size();
+  dropped = reader.orders().size() - records.size();
+  return true;
 }
@@ -5,21 +5,153 @@
 #define ENGINE_HPP
 
 #include <chrono>
+#include <csignal>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
+#include "clock.hpp"
+#include "exec_profile.hpp"
 #include "io.hpp"
+#include "journal.hpp"
+#include "order_book.hpp"
+#include "shard.hpp"
+
+// Per-client state, owned by whoever is serving the connection
+struct client_session {
+  // numbered from 1 in accept order, as recorded in the journal
+  uint32_t id = 0;
+  std::unordered_map<uint32_t, order_ref> orders;
+  // symbols this client has traded, so repeats skip the shared map
+  std::unordered_map<uint64_t, instrument *> instruments;
+  // where the client's latest order went; its rejects are ordered among
+  // that instrument's events
+  instrument *last_instrument = nullptr;
+  // orders sent since the last mass cancel, grouped by instrument so a mass
+  // cancel takes each lock once. Orders that have left the book are pruned
+  // from both maps once they hold twice as many as were live at the last
+  // prune, so they stay proportional to the client's resting orders.
+  std::unordered_map<instrument *, std::vector<owned_order>> by_instrument;
+  size_t prune_at = MIN_PRUNE_AT;
+  static constexpr size_t MIN_PRUNE_AT = 64;
+  // commands still owed to the framed batch being received, and the ones
+  // already in when a batch spans reads
+  uint32_t batch_remaining = 0;
+  std::vector<ClientCommand> batch;
+  // orders and cancels of a batch waiting to be grouped by instrument
+  std::vector<book_op> batch_ops;
+  // shards this client has sent commands to, by index
+  std::vector<bool> shards_used;
+};
+
+struct engine_options {
+  // serve all connections from this many epoll worker threads instead of
+  // one thread per connection; 0 keeps thread-per-connection
+  unsigned workers = 0;
+  // match on this many shard threads, each owning a slice of the
+  // instruments; 0 matches on the thread that read the command
+  unsigned shards = 0;
+  // where engine threads run and how they wait for clients
+  execution_profile profile;
+  // how instruments store their price levels
+  layout_policy book_layout = layout_policy::adaptive;
+  // cancel a client's resting orders when its connection goes away
+  bool cancel_on_disconnect = false;
+  // collect stats, dumped to stderr on SIGUSR1 or a stats command
+  bool stats = false;
+  // where SIGUSR2 writes a snapshot of the book
+  const char *snapshot_path = nullptr;
+  // append every command to this journal as it takes effect
+  journal_writer *journal = nullptr;
+};
+
+// Signals the engine handles on its own thread for these options. The
+// caller must block them in every thread before constructing the Engine.
+sigset_t engine_signals(const engine_options &options);
 
 struct Engine {
 public:
+  explicit Engine(engine_options options = {});
   void accept(ClientConnection conn);
+  // Re-drives the book from a journal as fast as it can, in journal order,
+  // returning once every command has been matched.
+  void replay(std::span<const journal_record> records);
+  // Writes every resting order to path, one instrument (or, when sharded,
+  // one shard) at a time while matching carries on elsewhere.
+  bool snapshot(const char *path);
+  // Loads a snapshot into the book; call before accepting connections.
+  // Connections do not outlive the engine, so restored orders have no owner
+  // until a client cancels or amends one by id; that client then owns it,
+  // for its mass cancels and cancel-on-disconnect too. Ids are only unique
+  // per client, so orders that share an id could be claimed by the wrong
+  // one; those are left out and counted in dropped.
+  bool restore(const char *path, size_t &orders, size_t &dropped);
 
 private:
-  void connection_thread(ClientConnection conn);
+  // a connection registered with the reactor, with its client state
+  struct reactor_connection {
+    ClientConnection connection;
+    client_session session;
+    // handed between workers by the one-shot rearm; this makes that handoff
+    // visible to the memory model, not just to the kernel
+    std::atomic<bool> serving{false};
+  };
+
+  engine_options options;
+  std::atomic<uint32_t> next_connection{1};
+  // round robin over the profile's engine cpus
+  std::atomic<size_t> next_engine_cpu{0};
+  int epollfd = -1;
+  std::vector<std::thread> workers;
+  std::vector<std::unique_ptr<matching_shard>> shards;
+  // restored orders no client has claimed yet, by id, and whether there
+  // may be any, so looking up a missing id usually skips the lock
+  std::unordered_map<uint32_t, order_ref> restored;
+  std::mutex restored_mtx;
+  std::atomic<bool> any_restored{false};
+
+  enum class drain_result {
+    // more may come, rearm the connection
+    pending,
+    closed,
+    // moved to a ring thread, forget about it
+    detached,
+  };
+
+  void pin_engine_thread();
+  void connection_thread(ClientConnection conn, uint32_t id);
+  void serve_ring(ClientConnection &connection, client_session &session);
+  void worker_thread();
+  drain_result drain(reactor_connection &conn);
+  void dispatch(client_session &session,
+                std::span<const ClientCommand> commands);
+  void handle_command(client_session &session, const ClientCommand &input);
+  void handle_batch(client_session &session,
+                    std::span<const ClientCommand> commands);
+  void flush_batch(client_session &session,
+                   std::span<const ClientCommand> commands);
+  void submit(client_session &session, shard_action action,
+              const ClientCommand &input, const order_ref &ref);
+  void journal(journal_entry kind, const client_session &session,
+               const ClientCommand &input);
+  order_ref new_order(client_session &session, const ClientCommand &input);
+  std::unordered_map<uint32_t, order_ref>::iterator
+  find_order(client_session &session, uint32_t order_id);
+  void prune_orders(client_session &session);
+  void reject(client_session &session, const ClientCommand &input);
+  void cancel_all(client_session &session);
+  void cancel_orders(client_session &session, instrument &instr,
+                     std::vector<owned_order> &orders);
+  void disconnected(client_session &session);
+  void signal_thread();
+  void dump_stats();
 };
 
-inline std::chrono::microseconds::rep getCurrentTimestamp() noexcept {
-  return std::chrono::duration_cast<std::chrono::nanoseconds>(
-             std::chrono::steady_clock::now().time_since_epoch())
-      .count();
+// nanoseconds on the same timeline as std::chrono::steady_clock
+inline std::chrono::nanoseconds::rep getCurrentTimestamp() noexcept {
+  return tsc_clock::now();
 }
 
 #endif
@@ -0,0 +1,123 @@
+#include "exec_profile.hpp"
+#include "affinity.hpp"
+
+#include <charconv>
+#include <fstream>
+#include <string>
+
+namespace {
+
+// value as an on/off switch, where an empty value means on
+bool parse_switch(std::string_view value, bool &out) {
+  if (value.empty() || value == "on" || value == "yes" || value == "1") {
+    out = true;
+  } else if (value == "off" || value == "no" || value == "0") {
+    out = false;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool parse_cpus(std::string_view value, std::vector<int> &out) {
+  std::vector<int> cpus = parse_cpu_list(value);
+  if (cpus.empty()) {
+    return false;
+  }
+  out = std::move(cpus);
+  return true;
+}
+
+std::string_view trim(std::string_view s) {
+  size_t first = s.find_first_not_of(" \t\r");
+  if (first == std::string_view::npos) {
+    return {};
+  }
+  size_t last = s.find_last_not_of(" \t\r");
+  return s.substr(first, last - first + 1);
+}
+
+} // namespace
+
+bool set_profile_option(execution_profile &profile, std::string_view name,
+                        std::string_view value) {
+  if (name == "engine-cpus") {
+    return parse_cpus(value, profile.engine_cpus);
+  }
+  if (name == "shard-cpus") {
+    return parse_cpus(value, profile.shard_cpus);
+  }
+  if (name == "housekeeping-cpus") {
+    return parse_cpus(value, profile.housekeeping_cpus);
+  }
+  if (name == "busy-poll") {
+    return parse_switch(value, profile.busy_poll);
+  }
+  if (name == "spin-us") {
+    unsigned us = 0;
+    auto result = std::from_chars(value.data(), value.data() + value.size(), us);
+    if (result.ec != std::errc{} || result.ptr != value.data() + value.size()) {
+      return false;
+    }
+    profile.spin_us = us;
+    return true;
+  }
+  return false;
+}
+
+bool load_profile(const char *path, execution_profile &profile,
+                  unsigned &bad_line) {
+  bad_line = 0;
+  std::ifstream file(path);
+  if (!file) {
+    return false;
+  }
+  std::string text;
+  unsigned number = 0;
+  while (std::getline(file, text)) {
+    number++;
+    std::string_view line = text;
+    line = trim(line.substr(0, line.find('#')));
+    if (line.empty()) {
+      continue;
+    }
+    size_t split = line.find_first_of(" \t");
+    std::string_view name = line.substr(0, split);
+    std::string_view value =
+        split == std::string_view::npos ? "" : trim(line.substr(split));
+    if (!set_profile_option(profile, name, value)) {
+      bad_line = number;
+      return false;
+    }
+  }
+  if (file.bad()) {
+    return false;
+  }
+  return true;
+}
+
+bool enter_housekeeping(execution_profile &profile) {
+  if (profile.housekeeping_cpus.empty()) {
+    return true;
+  }
+  profile.other_cpus.clear();
+  for (int cpu : current_thread_cpus()) {
+    if (std::find(profile.housekeeping_cpus.begin(),
+                  profile.housekeeping_cpus.end(),
+                  cpu) == profile.housekeeping_cpus.end()) {
+      profile.other_cpus.push_back(cpu);
+    }
+  }
+  return pin_current_thread(profile.housekeeping_cpus);
+}
+
+bool pin_engine_thread(const execution_profile &profile,
+                       const std::vector<int> &cpus, size_t index) {
+  if (!cpus.empty()) {
+    return pin_current_thread(cpus[index % cpus.size()]);
+  }
+  if (!profile.other_cpus.empty()) {
+    return pin_current_thread(profile.other_cpus);
+  }
+  return true;
+}
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "clock.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <string_view>
+#include <vector>
+
+// Execution profile.
+//
+// Where the engine's threads run and how they wait for input. Engine
+// threads (connection, worker, ring and shard threads) can each be pinned
+// to a cpu of their own, and the threads that only keep the engine going
+// (the accept loop, event writer, market data publisher and signal
+// thread) kept together on housekeeping cpus, out of their way.
+//
+// With busy polling, a thread waiting for a client keeps retrying its
+// nonblocking read for a while before it blocks, so a command arriving
+// soon after the last one is picked up without a wakeup.
+//
+// A profile can be set option by option or loaded from a file holding one
+// option per line, named as on the command line without the dashes:
+//
+//   # engine threads on 2-5, everything else on 0-1
+//   engine-cpus 2-5
+//   housekeeping-cpus 0,1
+//   busy-poll
+//   spin-us 50
+
+struct execution_profile {
+  // connection, worker and ring threads take one each, round robin; empty
+  // leaves them unpinned
+  std::vector<int> engine_cpus;
+  // the same for shard threads
+  std::vector<int> shard_cpus;
+  // shared by the housekeeping threads, and kept clear of engine threads
+  // that have no cpu listed
+  std::vector<int> housekeeping_cpus;
+  // read client sockets nonblocking and spin on them before blocking
+  bool busy_poll = false;
+  // longest a busy-polling thread spins before it blocks
+  unsigned spin_us = 100;
+
+  // every cpu we may run on apart from the housekeeping ones, filled in by
+  // enter_housekeeping
+  std::vector<int> other_cpus;
+};
+
+// Sets one option of profile. Returns false if name is not a profile
+// option or value does not suit it; a flag takes an empty value.
+bool set_profile_option(execution_profile &profile, std::string_view name,
+                        std::string_view value);
+
+// Sets every option listed in the file at path. Returns false if it could
+// not be read, with bad_line 0 and errno set, or on the first bad line,
+// with bad_line its number.
+bool load_profile(const char *path, execution_profile &profile,
+                  unsigned &bad_line);
+
+// Moves the calling thread onto the housekeeping cpus, if any, so every
+// thread it starts from now on runs there unless it pins itself. Call
+// from main before starting any thread.
+bool enter_housekeeping(execution_profile &profile);
+
+// Pins the calling engine thread to cpus[index % size], or off the
+// housekeeping cpus when cpus is empty.
+bool pin_engine_thread(const execution_profile &profile,
+                       const std::vector<int> &cpus, size_t index);
+
+// Spin-then-block with a spin budget that follows the gaps between
+// arrivals. A spin that sees the input arrive doubles the budget, up to
+// the limit; one that runs out halves it, so a client that has gone quiet
+// soon costs next to nothing before each block.
+class adaptive_spin {
+public:
+  explicit adaptive_spin(unsigned limit_us)
+      : limit(int64_t{limit_us} * 1000), budget(limit) {}
+
+  // Calls ready until it returns true or the budget runs out, returning
+  // whether it did; the caller blocks when it did not.
+  template <typename Ready> bool spin(Ready &&ready) {
+    if (budget == 0) {
+      return false;
+    }
+    int64_t start = tsc_clock::now();
+    while (true) {
+      if (ready()) {
+        budget = std::min(limit, budget * 2);
+        return true;
+      }
+      if (tsc_clock::now() - start >= budget) {
+        budget = std::max(MIN_BUDGET_NS, budget / 2);
+        return false;
+      }
+    }
+  }
+
+private:
+  static constexpr int64_t MIN_BUDGET_NS = 1000;
+
+  int64_t limit;
+  int64_t budget;
+};
@@ -0,0 +1,390 @@
+// Concurrent HashMap benchmark.
+//
+// Runs the same operation streams against HashMap and against a
+// std::unordered_map behind a std::shared_mutex, across thread counts,
+// read/write mixes and key distributions, and writes one CSV row per run
+// to stdout. Every operation is timed individually; throughput is timed
+// operations over wall time. Key streams are generated before the clock
+// starts, so the numbers are map cost alone. See usage() for the knobs.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <getopt.h>
+
+#include "../clock.hpp"
+#include "../histogram.hpp"
+#include "hash_map.hpp"
+
+namespace {
+
+// std::unordered_map behind one reader-writer lock, the obvious
+// alternative to HashMap
+class locked_map {
+public:
+  explicit locked_map(size_t initial_size) : map(initial_size) {}
+
+  void insert(uint64_t key, uint64_t value) {
+    std::unique_lock lock(mutex);
+    map.insert_or_assign(key, value);
+  }
+
+  bool contains(uint64_t key) {
+    std::shared_lock lock(mutex);
+    return map.contains(key);
+  }
+
+  bool remove(uint64_t key) {
+    std::unique_lock lock(mutex);
+    return map.erase(key) != 0;
+  }
+
+private:
+  std::shared_mutex mutex;
+  std::unordered_map<uint64_t, uint64_t> map;
+};
+
+enum class op_kind : uint64_t { read, insert, remove };
+
+// an operation with its key, packed so a stream of them stays small
+struct bench_op {
+  static constexpr unsigned KIND_SHIFT = 62;
+  uint64_t packed;
+
+  bench_op(op_kind kind, uint64_t key)
+      : packed(static_cast<uint64_t>(kind) << KIND_SHIFT | key) {}
+  op_kind kind() const { return static_cast<op_kind>(packed >> KIND_SHIFT); }
+  uint64_t key() const { return packed & ((uint64_t{1} << KIND_SHIFT) - 1); }
+};
+
+enum class distribution { uniform, zipf };
+
+const char *distribution_name(distribution dist) {
+  return dist == distribution::uniform ? "uniform" : "zipf";
+}
+
+// Draws key ranks 0..n-1, rank k with probability proportional to
+// 1/(k+1)^s, by binary search over the cumulative weights
+class zipf_keys {
+public:
+  zipf_keys(uint64_t n, double s) : cdf(n) {
+    double total = 0;
+    for (uint64_t k = 0; k < n; k++) {
+      total += 1.0 / std::pow(static_cast<double>(k + 1), s);
+      cdf[k] = total;
+    }
+    for (double &c : cdf) {
+      c /= total;
+    }
+  }
+
+  uint64_t operator()(std::mt19937_64 &rng) const {
+    double u = std::uniform_real_distribution<double>(0, 1)(rng);
+    auto it = std::lower_bound(cdf.begin(), cdf.end(), u);
+    return std::min<uint64_t>(it - cdf.begin(), cdf.size() - 1);
+  }
+
+private:
+  std::vector<double> cdf;
+};
+
+struct bench_config {
+  std::vector<unsigned> threads{1, 2, 4, 8};
+  // percentage of operations that are lookups
+  std::vector<unsigned> reads{100, 90, 50, 10};
+  std::vector<distribution> distributions{distribution::uniform,
+                                          distribution::zipf};
+  bool hashmap = true;
+  bool locked = true;
+  uint64_t ops = 200'000;
+  uint64_t keys = 10'000;
+  double zipf_s = 0.99;
+};
+
+struct run_spec {
+  const char *workload;
+  distribution dist;
+  unsigned threads;
+  unsigned read_pct;
+};
+
+// Lookups and an even split of inserts and removes over a fixed key space,
+// half of it filled beforehand, so the map keeps roughly the same size
+std::vector<bench_op> steady_ops(const bench_config &config,
+                                 const run_spec &spec, const zipf_keys &zipf,
+                                 unsigned thread) {
+  std::mt19937_64 rng(thread + 1);
+  std::uniform_int_distribution<uint64_t> uniform(0, config.keys - 1);
+  std::uniform_int_distribution<unsigned> percent(0, 99);
+  std::vector<bench_op> ops;
+  ops.reserve(config.ops);
+  for (uint64_t i = 0; i < config.ops; i++) {
+    uint64_t key =
+        spec.dist == distribution::zipf ? zipf(rng) : uniform(rng);
+    op_kind kind = percent(rng) < spec.read_pct ? op_kind::read
+                   : rng() & 1                  ? op_kind::insert
+                                                : op_kind::remove;
+    ops.emplace_back(kind, key);
+  }
+  return ops;
+}
+
+// Every write inserts a new key into a map that starts at 8 slots, so it
+// grows through many resizes; lookups hit a uniformly chosen key this
+// thread has already inserted
+std::vector<bench_op> resize_ops(const bench_config &config,
+                                 const run_spec &spec, unsigned thread) {
+  std::mt19937_64 rng(thread + 1);
+  std::uniform_int_distribution<unsigned> percent(0, 99);
+  uint64_t base = uint64_t{thread + 1} << 40;
+  uint64_t inserted = 0;
+  std::vector<bench_op> ops;
+  ops.reserve(config.ops);
+  for (uint64_t i = 0; i < config.ops; i++) {
+    if (inserted > 0 && percent(rng) < spec.read_pct) {
+      uint64_t index =
+          std::uniform_int_distribution<uint64_t>(0, inserted - 1)(rng);
+      ops.emplace_back(op_kind::read, base + index);
+    } else {
+      ops.emplace_back(op_kind::insert, base + inserted++);
+    }
+  }
+  return ops;
+}
+
+template <typename Map>
+void run_ops(Map &map, const std::vector<bench_op> &ops,
+             latency_histogram &latency) {
+  // keeps the lookups from being optimised away
+  uint64_t found = 0;
+  for (bench_op op : ops) {
+    int64_t start = tsc_clock::now();
+    switch (op.kind()) {
+    case op_kind::read:
+      found += map.contains(op.key());
+      break;
+    case op_kind::insert:
+      map.insert(op.key(), op.key());
+      break;
+    case op_kind::remove:
+      map.remove(op.key());
+      break;
+    }
+    latency.record(tsc_clock::now() - start);
+  }
+  static std::atomic<uint64_t> sink;
+  sink.fetch_add(found, std::memory_order_relaxed);
+}
+
+template <typename Map>
+void run(const char *map_name, const bench_config &config,
+         const run_spec &spec, const zipf_keys &zipf) {
+  bool resize = spec.workload == std::string_view("resize");
+  auto map = std::make_unique<Map>(resize ? 8 : config.keys);
+  if (!resize) {
+    for (uint64_t key = 0; key < config.keys; key += 2) {
+      map->insert(key, key);
+    }
+  }
+
+  std::vector<std::vector<bench_op>> streams;
+  for (unsigned i = 0; i < spec.threads; i++) {
+    streams.push_back(resize ? resize_ops(config, spec, i)
+                             : steady_ops(config, spec, zipf, i));
+  }
+  std::vector<latency_histogram> latencies(spec.threads);
+
+  // start together so the threads actually contend
+  std::atomic<unsigned> ready{0};
+  std::atomic<bool> go{false};
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < spec.threads; i++) {
+    threads.emplace_back([&, i] {
+      ready++;
+      while (!go.load(std::memory_order_acquire)) {
+        std::this_thread::yield();
+      }
+      run_ops(*map, streams[i], latencies[i]);
+    });
+  }
+  while (ready.load() != spec.threads) {
+    std::this_thread::yield();
+  }
+  int64_t start = tsc_clock::now();
+  go.store(true, std::memory_order_release);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  double seconds = static_cast<double>(tsc_clock::now() - start) / 1e9;
+
+  latency_histogram total;
+  for (const latency_histogram &latency : latencies) {
+    total.merge(latency);
+  }
+  printf("%s,%s,%s,%lu,%u,%u,%lu,%.6f,%.3f,%lu,%lu,%lu,%lu\n", map_name,
+         spec.workload, distribution_name(spec.dist), resize ? 0 : config.keys,
+         spec.threads, spec.read_pct, total.count(), seconds,
+         static_cast<double>(total.count()) / seconds / 1e6,
+         total.percentile(0.5), total.percentile(0.99),
+         total.percentile(0.999), total.max());
+  fflush(stdout);
+}
+
+// Parses a comma separated list of numbers, empty if it is malformed
+std::vector<unsigned> parse_list(const char *text) {
+  std::vector<unsigned> values;
+  while (*text) {
+    char *end;
+    unsigned long value = strtoul(text, &end, 10);
+    if (end == text || (*end != ',' && *end != '\0')) {
+      return {};
+    }
+    values.push_back(static_cast<unsigned>(value));
+    text = *end ? end + 1 : end;
+  }
+  return values;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [options] [workload...]\n"
+          "Workloads (default: all):\n"
+          "  steady   lookups, inserts and removes over a half full key "
+          "space\n"
+          "  resize   lookups and inserts of new keys into a map that "
+          "starts at 8\n"
+          "           slots, uniform keys only\n"
+          "Options:\n"
+          "  --threads <list> thread counts to run (default 1,2,4,8)\n"
+          "  --reads <list>   lookup percentages to run (default "
+          "100,90,50,10)\n"
+          "  --ops <n>        timed operations per thread (default 200000)\n"
+          "  --keys <n>       key space for steady (default 10000)\n"
+          "  --dist <name>    uniform or zipf keys (default both)\n"
+          "  --zipf <s>       zipf exponent (default 0.99)\n"
+          "  --map <name>     hashmap or locked (default both)\n"
+          "Writes CSV to stdout, one row per map and run (keys is 0 for "
+          "resize).\n",
+          prog);
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+  static const option long_options[] = {
+      {"threads", required_argument, nullptr, 't'},
+      {"reads", required_argument, nullptr, 'r'},
+      {"ops", required_argument, nullptr, 'o'},
+      {"keys", required_argument, nullptr, 'k'},
+      {"dist", required_argument, nullptr, 'd'},
+      {"zipf", required_argument, nullptr, 'z'},
+      {"map", required_argument, nullptr, 'm'},
+      {nullptr, 0, nullptr, 0},
+  };
+
+  bench_config config;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+    switch (opt) {
+    case 't':
+      config.threads = parse_list(optarg);
+      if (config.threads.empty() ||
+          std::count(config.threads.begin(), config.threads.end(), 0u)) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'r':
+      config.reads = parse_list(optarg);
+      if (config.reads.empty() ||
+          *std::max_element(config.reads.begin(), config.reads.end()) > 100) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'o':
+      config.ops = std::max(1ull, strtoull(optarg, nullptr, 10));
+      break;
+    case 'k':
+      config.keys = std::max(1ull, strtoull(optarg, nullptr, 10));
+      break;
+    case 'd':
+      if (optarg == std::string("uniform")) {
+        config.distributions = {distribution::uniform};
+      } else if (optarg == std::string("zipf")) {
+        config.distributions = {distribution::zipf};
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'z':
+      config.zipf_s = strtod(optarg, nullptr);
+      break;
+    case 'm':
+      config.hashmap = optarg == std::string("hashmap");
+      config.locked = optarg == std::string("locked");
+      if (!config.hashmap && !config.locked) {
+        usage(argv[0]);
+        return 1;
+      }
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  static const char *const WORKLOADS[] = {"steady", "resize"};
+  std::vector<const char *> selected;
+  for (int i = optind; i < argc; i++) {
+    auto found = std::find_if(
+        std::begin(WORKLOADS), std::end(WORKLOADS),
+        [&](const char *name) { return argv[i] == std::string(name); });
+    if (found == std::end(WORKLOADS)) {
+      usage(argv[0]);
+      return 1;
+    }
+    selected.push_back(*found);
+  }
+  if (selected.empty()) {
+    selected.assign(std::begin(WORKLOADS), std::end(WORKLOADS));
+  }
+
+  tsc_clock::init();
+  zipf_keys zipf(config.keys, config.zipf_s);
+  printf("map,workload,distribution,keys,threads,read_pct,ops,seconds,mops,"
+         "p50_ns,p99_ns,p999_ns,max_ns\n");
+  for (const char *workload : selected) {
+    bool resize = workload == std::string_view("resize");
+    for (distribution dist : config.distributions) {
+      if (resize && dist != distribution::uniform) {
+        continue;
+      }
+      for (unsigned threads : config.threads) {
+        for (unsigned read_pct : config.reads) {
+          run_spec spec{workload, dist, threads, read_pct};
+          if (config.hashmap) {
+            run<HashMap<uint64_t, uint64_t>>("hashmap", config, spec, zipf);
+          }
+          if (config.locked) {
+            run<locked_map>("locked", config, spec, zipf);
+          }
+        }
+      }
+    }
+  }
+  return 0;
+}
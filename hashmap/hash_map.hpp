@@ -1,184 +1,482 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
 #include <functional>
-#include <list>
-#include <vector>
-#include <shared_mutex>
+#include <memory>
 #include <mutex>
-#include <atomic>
 #include <stdexcept>
+#include <thread>
+#include <vector>
 
 const size_t DEFAULT_INITIAL_SIZE = 100;
 const float DEFAULT_LOAD_FACTOR = 0.7f;
 
-template <typename K, typename V>
+// Concurrent open-addressing hash map.
+//
+// Slots hold a pointer to an immutable node with the top 16 bits of the hash
+// packed above the 48-bit address, so most probes never touch a node that
+// does not match. Readers are lock-free: they only load slots. Writers
+// serialise per key on a striped, cache-line-padded lock and claim slots
+// with CAS.
+//
+// Growing allocates a second table and moves slots over in chunks, each
+// writer that comes along migrating one chunk, so no single operation pays
+// for the whole copy and readers are never blocked. While a migration is in
+// flight readers look in the old table first and then the new one; moved
+// slots are marked so nothing can be inserted behind a reader's back.
+//
+// Nodes are never modified after publication: updating a key swaps in a new
+// node. Replaced and removed nodes, and drained tables, are not freed while
+// the map is in use, since a reader may still hold them; references
+// returned by get() therefore stay valid until reclaim() or destruction.
+// The map does not track readers, so memory grows with every overwrite and
+// remove until the owner calls reclaim() at a point where no other thread
+// is using the map. Insert-mostly uses, such as the engine's instrument
+// table, never need to.
+template <typename K, typename V, typename Hash = std::hash<K>>
 class HashMap
 {
 private:
-  using Bucket = std::list<std::pair<K, V>>;
-  std::vector<Bucket> buckets;
-  std::vector<std::shared_mutex> bucket_mutexes;
+  static_assert(sizeof(void *) == 8, "slot packing assumes 64-bit pointers");
+
+  struct Node
+  {
+    size_t hash;
+    K key;
+    V value;
+  };
+
+  static constexpr uintptr_t EMPTY = 0;
+  static constexpr uintptr_t TOMBSTONE = 1;
+  static constexpr uintptr_t MOVED = 2;
+  static constexpr uintptr_t POINTER_MASK = (uintptr_t(1) << 48) - 1;
+  static constexpr size_t MIGRATE_CHUNK = 256;
+  static constexpr size_t NUM_STRIPES = 64;
+
+  struct Table
+  {
+    size_t mask;
+    std::unique_ptr<std::atomic<uintptr_t>[]> slots;
+    std::atomic<size_t> used{0};      // live + tombstone slots
+    std::atomic<size_t> max_probe{0}; // longest displacement of any insert
+    std::atomic<Table *> next{nullptr};
+    std::atomic<size_t> migrate_cursor{0};
+    std::atomic<size_t> migrated{0};
+
+    explicit Table(size_t capacity)
+        : mask(capacity - 1), slots(new std::atomic<uintptr_t>[capacity])
+    {
+      for (size_t i = 0; i < capacity; i++)
+      {
+        slots[i].store(EMPTY, std::memory_order_relaxed);
+      }
+    }
+
+    size_t capacity() const { return mask + 1; }
+  };
+
+  struct alignas(64) PaddedMutex
+  {
+    std::mutex m;
+  };
+
+  std::atomic<Table *> current;
   std::atomic<size_t> num_elements; // atomic to prevent data races, ordering doesn't matter as much
   float max_load_factor = DEFAULT_LOAD_FACTOR;
-  std::shared_mutex rehash_mutex;
+  std::array<PaddedMutex, NUM_STRIPES> stripes;
+
+  // everything that may still be referenced by a reader, freed on destruction
+  std::mutex retired_mutex;
+  std::vector<std::unique_ptr<Table>> tables;
+  std::vector<Node *> retired_nodes;
 
-  size_t hash(const K &key) const
+  static size_t mix(size_t h)
   {
-    return std::hash<K>{}(key) % buckets.size();
+    h ^= h >> 32;
+    h *= 0x9e3779b97f4a7c15ULL;
+    h ^= h >> 29;
+    return h;
   }
 
-  void rehash()
+  size_t hash(const K &key) const { return mix(Hash{}(key)); }
+
+  static uintptr_t pack(Node *node)
   {
-    std::unique_lock<std::shared_mutex> lock(rehash_mutex);
-    size_t new_size = buckets.size() * 2;
-    std::vector<Bucket> new_buckets(new_size);
-    std::vector<std::shared_mutex> new_bucket_mutexes(new_size);
+    return reinterpret_cast<uintptr_t>(node) | (node->hash & ~POINTER_MASK);
+  }
 
-    for (auto &bucket : buckets)
+  static bool is_node(uintptr_t slot) { return slot > MOVED; }
+
+  static Node *node_of(uintptr_t slot)
+  {
+    return reinterpret_cast<Node *>(slot & POINTER_MASK);
+  }
+
+  static bool tag_matches(uintptr_t slot, size_t h)
+  {
+    return (slot & ~POINTER_MASK) == (h & ~POINTER_MASK);
+  }
+
+  std::mutex &stripe(size_t h) { return stripes[h % NUM_STRIPES].m; }
+
+  // Index of the slot holding key in t, or -1, and the node seen there.
+  // Lock-free.
+  static intptr_t find_slot(Table *t, size_t h, const K &key, Node *&found)
+  {
+    size_t limit = t->max_probe.load(std::memory_order_acquire);
+    for (size_t i = 0; i <= limit && i <= t->mask; i++)
     {
-      for (auto &pair : bucket)
+      size_t index = (h + i) & t->mask;
+      uintptr_t slot = t->slots[index].load(std::memory_order_acquire);
+      if (slot == EMPTY)
       {
-        size_t new_index = std::hash<K>{}(pair.first) % new_size;
-        new_buckets[new_index].push_back(pair);
+        return -1;
+      }
+      if (is_node(slot) && tag_matches(slot, h))
+      {
+        Node *node = node_of(slot);
+        if (node->hash == h && node->key == key)
+        {
+          found = node;
+          return static_cast<intptr_t>(index);
+        }
       }
     }
+    return -1;
+  }
 
-    buckets = std::move(new_buckets);
-    bucket_mutexes = std::move(new_bucket_mutexes);
+  Node *find_node(size_t h, const K &key)
+  {
+    Table *t = current.load(std::memory_order_acquire);
+    while (t)
+    {
+      Node *node;
+      if (find_slot(t, h, key, node) >= 0)
+      {
+        return node;
+      }
+      // not here, or moved before we got to it: try the table it went to
+      t = t->next.load(std::memory_order_acquire);
+    }
+    return nullptr;
   }
 
-public:
-  HashMap(size_t initial_size = DEFAULT_INITIAL_SIZE)
-      : buckets(initial_size), bucket_mutexes(initial_size), num_elements(0) {}
+  // Claims a free slot in t for node. Caller holds the node's stripe and
+  // has checked the key is absent. Fails if t is full or is being drained.
+  static bool place(Table *t, Node *node)
+  {
+    uintptr_t packed = pack(node);
+    for (size_t i = 0; i <= t->mask; i++)
+    {
+      size_t index = (node->hash + i) & t->mask;
+      uintptr_t slot = t->slots[index].load(std::memory_order_acquire);
+      while (slot == EMPTY || slot == TOMBSTONE)
+      {
+        // publish the displacement before the slot so readers scan far enough
+        size_t probe = t->max_probe.load(std::memory_order_relaxed);
+        while (probe < i && !t->max_probe.compare_exchange_weak(probe, i, std::memory_order_release))
+        {
+        }
+        if (t->slots[index].compare_exchange_strong(slot, packed, std::memory_order_acq_rel))
+        {
+          if (slot == EMPTY)
+          {
+            t->used.fetch_add(1, std::memory_order_relaxed);
+          }
+          return true;
+        }
+      }
+      if (slot == MOVED)
+      {
+        return false;
+      }
+    }
+    return false;
+  }
 
-  void insert(const K &key, const V &value)
+  void retire(Node *node)
   {
-    std::shared_lock<std::shared_mutex> rehash_lock(rehash_mutex);
-    size_t index = hash(key);
-    auto &m = bucket_mutexes[index];
-    std::unique_lock<std::shared_mutex> lock(m);
+    std::scoped_lock<std::mutex> lock(retired_mutex);
+    retired_nodes.push_back(node);
+  }
 
-    // Check for existing key
-    for (auto &pair : buckets[index])
+  // Starts moving t into a fresh table, unless that has already begun.
+  void begin_resize(Table *t)
+  {
+    if (t->next.load(std::memory_order_acquire))
+    {
+      return;
+    }
+    std::scoped_lock<std::mutex> lock(retired_mutex);
+    if (t->next.load(std::memory_order_acquire))
+    {
+      return;
+    }
+    // mostly tombstones: rebuild at the same size instead of doubling
+    size_t capacity = t->capacity();
+    if (static_cast<float>(num_elements.load()) > capacity * max_load_factor / 2)
     {
-      if (pair.first == key)
+      capacity *= 2;
+    }
+    Table *n = tables.emplace_back(std::make_unique<Table>(capacity)).get();
+    t->next.store(n, std::memory_order_release);
+  }
+
+  // Moves one chunk of t into t->next. Must not be called with a stripe held.
+  void migrate_chunk(Table *t)
+  {
+    Table *n = t->next.load(std::memory_order_acquire);
+    size_t start = t->migrate_cursor.fetch_add(MIGRATE_CHUNK, std::memory_order_relaxed);
+    if (start > t->mask)
+    {
+      return;
+    }
+    size_t end = std::min(start + MIGRATE_CHUNK, t->capacity());
+    for (size_t index = start; index < end; index++)
+    {
+      std::atomic<uintptr_t> &cell = t->slots[index];
+      uintptr_t slot = cell.load(std::memory_order_acquire);
+      while (!is_node(slot))
+      {
+        if (cell.compare_exchange_weak(slot, MOVED, std::memory_order_acq_rel))
+        {
+          break;
+        }
+      }
+      if (!is_node(slot))
+      {
+        continue;
+      }
+      // the key's writers hold its stripe, so it cannot change under us
+      std::scoped_lock<std::mutex> lock(stripe(node_of(slot)->hash));
+      slot = cell.load(std::memory_order_acquire);
+      if (is_node(slot))
       {
-        pair.second = value;
-        return;
+        // n normally has room, but a writer that found it full may already
+        // have started draining it; then the node goes further down the
+        // chain, where readers and writers of this key look next
+        Table *to = n;
+        while (!place(to, node_of(slot)))
+        {
+          begin_resize(to);
+          to = to->next.load(std::memory_order_acquire);
+        }
       }
+      cell.store(MOVED, std::memory_order_release);
     }
+    if (t->migrated.fetch_add(end - start, std::memory_order_acq_rel) + (end - start) == t->capacity())
+    {
+      current.compare_exchange_strong(t, n, std::memory_order_acq_rel);
+    }
+  }
 
-    // Insert new pair
-    buckets[index].emplace_back(key, value);
-    num_elements.fetch_add(1, std::memory_order_acq_rel);
-
-    // Check load factor
-    if (static_cast<float>(num_elements) / static_cast<float>(buckets.size()) > max_load_factor)
+  // Helps any in-flight migration along by one chunk.
+  void help_migrate()
+  {
+    Table *t = current.load(std::memory_order_acquire);
+    if (t->next.load(std::memory_order_acquire))
     {
-      lock.unlock(); // unlock before rehashing to prevent lock-order-inversion (potential deadlock)
-      rehash_lock.unlock();
-      rehash();
+      migrate_chunk(t);
     }
   }
 
-  // Inserts only if key doesn't exist
-  void try_insert(const K &key, const V &value)
+  enum class Mode
   {
-    std::shared_lock<std::shared_mutex> rehash_lock(rehash_mutex);
-    size_t index = hash(key);
-    auto &m = bucket_mutexes[index];
-    std::unique_lock<std::shared_mutex> lock(m);
+    Overwrite,
+    KeepExisting
+  };
 
-    // Check for existing key
-    for (auto &pair : buckets[index])
+  // Shared body of insert/try_insert/get_or_insert. Returns the node that
+  // holds the key afterwards. make() runs at most once, under the key's
+  // stripe.
+  template <typename F>
+  Node *upsert(const K &key, F &&make, Mode mode)
+  {
+    size_t h = hash(key);
+    help_migrate();
+    std::unique_lock<std::mutex> lock(stripe(h));
+
+    // the key is in exactly one table of the chain, find it
+    Table *t = current.load(std::memory_order_acquire);
+    Table *last = t;
+    for (Table *it = t; it; it = it->next.load(std::memory_order_acquire))
     {
-      if (pair.first == key)
+      last = it;
+      Node *existing;
+      intptr_t index = find_slot(it, h, key, existing);
+      if (index < 0)
+      {
+        continue;
+      }
+      if (mode == Mode::KeepExisting)
       {
-        return;
+        return existing;
       }
+      Node *node = new Node{h, key, make()};
+      it->slots[index].store(pack(node), std::memory_order_release);
+      lock.unlock();
+      retire(existing);
+      return node;
     }
 
-    // Insert new pair
-    buckets[index].emplace_back(key, value);
+    // absent: new keys always go into the newest table. If that is drained
+    // or full under us, follow the chain still holding the stripe, as
+    // migrate_chunk does, so no other writer can add the key meanwhile and
+    // the node made for it is never thrown away.
+    Node *node = new Node{h, key, make()};
+    Table *to = last;
+    while (!place(to, node))
+    {
+      begin_resize(to);
+      to = to->next.load(std::memory_order_acquire);
+    }
     num_elements.fetch_add(1, std::memory_order_acq_rel);
+    lock.unlock();
 
-    // Check load factor
-    if (static_cast<float>(num_elements) / static_cast<float>(buckets.size()) > max_load_factor)
+    // only the live table may start a resize, the new table waits its turn
+    if (to == current.load(std::memory_order_acquire) &&
+        static_cast<float>(to->used.load(std::memory_order_relaxed)) >
+            static_cast<float>(to->capacity()) * max_load_factor)
     {
-      lock.unlock(); // unlock before rehashing to prevent lock-order-inversion (potential deadlock)
-      rehash_lock.unlock();
-      rehash();
+      begin_resize(to);
+      migrate_chunk(to);
     }
+    return node;
   }
 
-  bool contains(const K &key)
+public:
+  HashMap(size_t initial_size = DEFAULT_INITIAL_SIZE) : num_elements(0)
   {
-    std::shared_lock<std::shared_mutex> rehash_lock(rehash_mutex);
-    size_t index = hash(key);
-    auto &m = bucket_mutexes[index];
-    std::shared_lock<std::shared_mutex> lock(m);
+    size_t capacity = std::bit_ceil(std::max<size_t>(initial_size, 8));
+    Table *t = tables.emplace_back(std::make_unique<Table>(capacity)).get();
+    current.store(t, std::memory_order_release);
+  }
 
-    for (const auto &pair : buckets[index])
+  ~HashMap()
+  {
+    for (auto &t : tables)
     {
-      if (pair.first == key)
+      for (size_t i = 0; i <= t->mask; i++)
       {
-        return true;
+        uintptr_t slot = t->slots[i].load(std::memory_order_relaxed);
+        if (is_node(slot))
+        {
+          delete node_of(slot);
+        }
       }
     }
-    return false;
+    for (Node *node : retired_nodes)
+    {
+      delete node;
+    }
   }
 
-  V &get(const K &key)
+  HashMap(const HashMap &) = delete;
+  HashMap &operator=(const HashMap &) = delete;
+
+  void insert(const K &key, const V &value)
+  {
+    upsert(key, [&value] { return value; }, Mode::Overwrite);
+  }
+
+  // Inserts only if key doesn't exist
+  void try_insert(const K &key, const V &value)
   {
-    std::shared_lock<std::shared_mutex> rehash_lock(rehash_mutex);
-    size_t index = hash(key);
-    auto &m = bucket_mutexes[index];
-    std::shared_lock<std::shared_mutex> lock(m);
+    upsert(key, [&value] { return value; }, Mode::KeepExisting);
+  }
 
-    for (auto &pair : buckets[index])
+  // Returns the value for key, inserting make() first if it is missing.
+  // make is only called when the key is absent, under the key's stripe lock.
+  template <typename F>
+  V get_or_insert(const K &key, F &&make)
+  {
+    size_t h = hash(key);
+    if (Node *node = find_node(h, key))
     {
-      if (pair.first == key)
-      {
-        return pair.second;
-      }
+      return node->value;
+    }
+    return upsert(key, std::forward<F>(make), Mode::KeepExisting)->value;
+  }
+
+  bool contains(const K &key)
+  {
+    return find_node(hash(key), key) != nullptr;
+  }
+
+  V &get(const K &key)
+  {
+    if (Node *node = find_node(hash(key), key))
+    {
+      return node->value;
     }
     throw std::out_of_range("Key not found");
   }
 
   bool remove(const K &key)
   {
-    std::shared_lock<std::shared_mutex> rehash_lock(rehash_mutex);
-    size_t index = hash(key);
-    auto &m = bucket_mutexes[index];
-    std::unique_lock<std::shared_mutex> lock(m);
-
-    auto &bucket = buckets[index];
+    size_t h = hash(key);
+    help_migrate();
+    std::unique_lock<std::mutex> lock(stripe(h));
 
-    for (auto it = bucket.begin(); it != bucket.end(); ++it)
+    for (Table *t = current.load(std::memory_order_acquire); t; t = t->next.load(std::memory_order_acquire))
     {
-      if (it->first == key)
+      Node *node;
+      intptr_t index = find_slot(t, h, key, node);
+      if (index < 0)
       {
-        bucket.erase(it);
-        num_elements.fetch_sub(1, std::memory_order_relaxed);
-        return true;
+        continue;
       }
+      t->slots[index].store(TOMBSTONE, std::memory_order_release);
+      num_elements.fetch_sub(1, std::memory_order_relaxed);
+      lock.unlock();
+      retire(node);
+      return true;
     }
     return false;
   }
 
+  // Frees replaced and removed nodes and drained tables. Only safe while
+  // no other thread is using the map and no reference from get() is held.
+  void reclaim()
+  {
+    std::scoped_lock<std::mutex> lock(retired_mutex);
+    for (Node *node : retired_nodes)
+    {
+      delete node;
+    }
+    retired_nodes.clear();
+    // tables are added in order, so everything before the live one is drained
+    Table *live = current.load(std::memory_order_acquire);
+    auto it = std::find_if(tables.begin(), tables.end(), [live](const auto &t) { return t.get() == live; });
+    tables.erase(tables.begin(), it);
+  }
+
   size_t size() const { return num_elements; }
   bool empty() const { return num_elements == 0; }
 
   // for debugging purposes
   std::vector<K> keys()
   {
-    std::unique_lock<std::shared_mutex> lock(rehash_mutex);
+    // with every stripe held no slot is mid-move, so each key is seen once
+    std::vector<std::unique_lock<std::mutex>> locks;
+    for (auto &s : stripes)
+    {
+      locks.emplace_back(s.m);
+    }
     std::vector<K> keys;
-    for (const auto &bucket : buckets)
+    for (Table *t = current.load(std::memory_order_acquire); t; t = t->next.load(std::memory_order_acquire))
     {
-      for (const auto &pair : bucket)
+      for (size_t i = 0; i <= t->mask; i++)
       {
-        keys.push_back(pair.first);
+        uintptr_t slot = t->slots[i].load(std::memory_order_acquire);
+        if (is_node(slot))
+        {
+          keys.push_back(node_of(slot)->key);
+        }
       }
     }
     return keys;
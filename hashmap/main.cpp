@@ -1,4 +1,5 @@
 #include "hash_map.hpp"
+#include <atomic>
 #include <cassert>
 #include <iostream>
 #include <thread>
@@ -92,6 +93,27 @@ void test_objects() {
   assert(!people.contains(2));
 }
 
+// Test lookup-or-create: make() only runs for missing keys.
+void test_get_or_insert() {
+  HashMap<int, int> map;
+  int calls = 0;
+  auto make = [&calls] { return ++calls * 10; };
+
+  assert(map.get_or_insert(1, make) == 10);
+  assert(map.get_or_insert(1, make) == 10);
+  assert(calls == 1);
+  assert(map.get_or_insert(2, make) == 20);
+  assert(map.size() == 2);
+
+  // enough keys to force a rehash, all still reachable afterwards
+  for (int i = 3; i < 500; ++i) {
+    map.get_or_insert(i, [i] { return i; });
+  }
+  for (int i = 3; i < 500; ++i) {
+    assert(map.get(i) == i);
+  }
+}
+
 // --- Concurrent Test Functions ---
 
 const int NUM_INSERT_THREADS = 4;
@@ -126,12 +148,115 @@ void checkContains(HashMap<int, int> &map, int thread_id) {
   std::cout << "Contains thread " << thread_id << " finished" << std::endl;
 }
 
+// Readers must keep finding existing keys while writers force resizes.
+void test_concurrent_resize() {
+  const int STABLE_KEYS = 1000;
+  const int GROWTH_KEYS = 20000;
+  HashMap<int, int> map(8);
+  for (int i = 0; i < STABLE_KEYS; ++i) {
+    map.insert(i, i);
+  }
+
+  std::atomic<bool> done = false;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < NUM_INSERT_THREADS; ++t) {
+    threads.emplace_back([&map, t] {
+      for (int i = STABLE_KEYS + t; i < STABLE_KEYS + GROWTH_KEYS;
+           i += NUM_INSERT_THREADS) {
+        map.insert(i, i);
+        if (i % 3 == 0) {
+          assert(map.remove(i));
+        }
+      }
+    });
+  }
+  for (int t = 0; t < NUM_CONTAINS_THREADS; ++t) {
+    threads.emplace_back([&map, &done] {
+      while (!done) {
+        for (int i = 0; i < STABLE_KEYS; ++i) {
+          assert(map.get(i) == i);
+        }
+      }
+    });
+  }
+  for (int t = 0; t < NUM_INSERT_THREADS; ++t) {
+    threads[t].join();
+  }
+  done = true;
+  for (size_t t = NUM_INSERT_THREADS; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+
+  size_t expected = STABLE_KEYS;
+  for (int i = STABLE_KEYS; i < STABLE_KEYS + GROWTH_KEYS; ++i) {
+    assert(map.contains(i) == (i % 3 != 0));
+    expected += i % 3 != 0;
+  }
+  assert(map.size() == expected);
+  assert(map.keys().size() == expected);
+}
+
+// Threads racing to get_or_insert the same keys while the table grows from
+// tiny must call make() exactly once per key, however often a resize gets
+// in the way.
+void test_get_or_insert_once() {
+  const int KEYS = 20000;
+  HashMap<int, int> map(8);
+  std::atomic<int> calls = 0;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < NUM_INSERT_THREADS; ++t) {
+    threads.emplace_back([&map, &calls, t] {
+      // each thread walks the keys from a different place, so every key is
+      // contended at some point
+      for (int n = 0; n < KEYS; ++n) {
+        int key = (n + t * KEYS / NUM_INSERT_THREADS) % KEYS;
+        int value = map.get_or_insert(key, [&calls, key] {
+          calls.fetch_add(1);
+          return key;
+        });
+        assert(value == key);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  assert(calls == KEYS);
+  assert(map.size() == static_cast<size_t>(KEYS));
+}
+
+// Overwrites and removes retire nodes; reclaim() frees them and the drained
+// tables at a quiet point, leaving every live key in place.
+void test_reclaim() {
+  HashMap<int, int> map(8);
+  for (int round = 0; round < 10; ++round) {
+    for (int i = 0; i < 1000; ++i) {
+      map.insert(i, i + round);
+    }
+    for (int i = 0; i < 1000; i += 2) {
+      assert(map.remove(i));
+    }
+    map.reclaim();
+    for (int i = 0; i < 1000; ++i) {
+      assert(map.contains(i) == (i % 2 != 0));
+      if (i % 2 != 0) {
+        assert(map.get(i) == i + round);
+      }
+    }
+  }
+  assert(map.size() == 500);
+}
+
 int main() {
   // Run basic, edge, data type, and object tests.
   test_basic_operations();
   test_edge_cases();
   test_data_types();
   test_objects();
+  test_get_or_insert();
+  test_concurrent_resize();
+  test_get_or_insert_once();
+  test_reclaim();
 
   // Concurrent test: perform concurrent insertions and lookups.
   HashMap<int, int> concurrent_map;
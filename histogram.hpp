@@ -0,0 +1,86 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+
+// Log-linear latency histogram in the style of HdrHistogram.
+//
+// Values below 2^SUB_BITS are counted exactly; above that every power of two
+// is split into 2^(SUB_BITS-1) equal buckets, so a reported percentile is
+// within 1/64 of the true value. Recording is a couple of shifts and an
+// increment, cheap enough to do on every operation. Histograms from
+// different threads are combined with merge().
+class latency_histogram {
+public:
+  static constexpr unsigned SUB_BITS = 7;
+  static constexpr size_t BUCKETS = (64 - SUB_BITS + 2) << (SUB_BITS - 1);
+
+  void record(uint64_t value, uint64_t times = 1) {
+    counts[bucket_of(value)] += times;
+    total += times;
+    sum += value * times;
+    min_value = std::min(min_value, value);
+    max_value = std::max(max_value, value);
+  }
+
+  void merge(const latency_histogram &other) {
+    for (size_t i = 0; i < BUCKETS; i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    sum += other.sum;
+    min_value = std::min(min_value, other.min_value);
+    max_value = std::max(max_value, other.max_value);
+  }
+
+  void reset() { *this = latency_histogram{}; }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? min_value : 0; }
+  uint64_t max() const { return max_value; }
+  double mean() const { return total ? static_cast<double>(sum) / total : 0; }
+
+  // Smallest recorded bucket holding at least q (0 to 1) of the values,
+  // reported as that bucket's upper edge and never above max().
+  uint64_t percentile(double q) const {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total));
+    rank = std::clamp<uint64_t>(rank, 1, total);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(upper_edge(i), max_value);
+      }
+    }
+    return max_value;
+  }
+
+  static size_t bucket_of(uint64_t value) {
+    if (value < (1u << SUB_BITS)) {
+      return value;
+    }
+    unsigned msb = 63 - __builtin_clzll(value);
+    unsigned shift = msb - (SUB_BITS - 1);
+    return (static_cast<size_t>(shift) << (SUB_BITS - 1)) + (value >> shift);
+  }
+
+  static uint64_t upper_edge(size_t bucket) {
+    if (bucket < (1u << SUB_BITS)) {
+      return bucket;
+    }
+    unsigned shift = static_cast<unsigned>(bucket >> (SUB_BITS - 1)) - 1;
+    uint64_t sub = bucket - (static_cast<uint64_t>(shift) << (SUB_BITS - 1));
+    return ((sub + 1) << shift) - 1;
+  }
+
+private:
+  std::array<uint64_t, BUCKETS> counts{};
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  uint64_t min_value = UINT64_MAX;
+  uint64_t max_value = 0;
+};
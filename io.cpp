@@ -1,11 +1,16 @@
 // This file contains I/O functions.
 // There should be no need to modify this file.
 
+#include <cerrno>
+#include <cstring>
+
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/socket.h>
 
 #include "io.hpp"
 #include "engine.hpp"
+#include "stats.hpp"
 
 // out of line definitions for the mutexes in SyncCerr/SyncCout
 std::mutex SyncCerr::mut;
@@ -20,17 +25,83 @@ void ClientConnection::freeHandle()
 	}
 }
 
-ReadResult ClientConnection::readInput(ClientCommand& read_into)
+bool ClientConnection::setNonBlocking()
 {
-	switch(read(m_handle, &read_into, sizeof(ClientCommand)))
+	int flags = fcntl(m_handle, F_GETFL);
+	return flags != -1 && fcntl(m_handle, F_SETFL, flags | O_NONBLOCK) != -1;
+}
+
+// read(), except that with stats on it first tries a nonblocking recv() and
+// times it if data was already waiting; time spent blocked waiting for the
+// client is not part of the read stage.
+static ssize_t readSome(int fd, char* buf, size_t len)
+{
+	if(stats::enabled())
 	{
-		case 0: //
-			return ReadResult::EndOfFile;
+		int64_t start = tsc_clock::now();
+		ssize_t n = recv(fd, buf, len, MSG_DONTWAIT);
+		if(n > 0)
+			stats::record(stage::read, tsc_clock::now() - start);
+		if(n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			return n;
+	}
+	return read(fd, buf, len);
+}
 
-		case sizeof(ClientCommand): //
-			return ReadResult::Success;
+// One read() into the free space of the buffer, after moving any partial
+// command to the front.
+ReadResult ClientConnection::fill()
+{
+	if(m_begin != 0)
+	{
+		memmove(m_buffer.get(), m_buffer.get() + m_begin, m_end - m_begin);
+		m_end -= m_begin;
+		m_begin = 0;
+	}
 
-		default: //
+	while(true)
+	{
+		ssize_t n = readSome(m_handle, m_buffer.get() + m_end, BUFFER_COMMANDS * sizeof(ClientCommand) - m_end);
+		if(n > 0)
+		{
+			m_end += static_cast<size_t>(n);
+			return ReadResult::Success;
+		}
+		if(n == 0)
+			// a half-sent command at end of stream is a protocol error
+			return m_end == 0 ? ReadResult::EndOfFile : ReadResult::Error;
+		if(errno == EAGAIN || errno == EWOULDBLOCK)
+			return ReadResult::WouldBlock;
+		if(errno != EINTR)
 			return ReadResult::Error;
 	}
 }
+
+ReadResult ClientConnection::readInput(ClientCommand& read_into)
+{
+	while(buffered() == 0)
+	{
+		ReadResult result = this->fill();
+		if(result != ReadResult::Success)
+			return result;
+	}
+
+	memcpy(&read_into, m_buffer.get() + m_begin, sizeof(ClientCommand));
+	m_begin += sizeof(ClientCommand);
+	return ReadResult::Success;
+}
+
+ReadResult ClientConnection::readBatch(std::span<const ClientCommand>& commands)
+{
+	while(buffered() == 0)
+	{
+		ReadResult result = this->fill();
+		if(result != ReadResult::Success)
+			return result;
+	}
+
+	size_t count = buffered();
+	commands = { reinterpret_cast<const ClientCommand*>(m_buffer.get() + m_begin), count };
+	m_begin += count * sizeof(ClientCommand);
+	return ReadResult::Success;
+}
@@ -3,16 +3,47 @@
 
 #pragma once
 
+#include <memory>
 #include <mutex>
+#include <span>
 #include <utility>
 #include <cstdint>
 #include <iostream>
+#include <string_view>
+
+#include "output.hpp"
+#include "stats.hpp"
+#include "symbol.hpp"
 
 enum CommandType
 {
 	input_buy = 'B',
 	input_sell = 'S',
-	input_cancel = 'C'
+	input_cancel = 'C',
+	// change a resting order's price and count; count 0 cancels it
+	input_amend = 'A',
+	// cancel every order the client still has resting
+	input_cancel_all = 'M',
+	// dump engine stats to stderr
+	input_stats = 'T',
+	// switch this connection to a shared-memory ring (see shm_ring.hpp);
+	// must come alone, before any other command
+	input_ring = 'H',
+	// header of a framed batch: the next `count` commands are one batch
+	input_batch = 'F'
+};
+
+// What happens to the part of a new order that does not fill on arrival
+enum OrderKind : uint8_t
+{
+	// rests in the book
+	order_limit = 0,
+	// immediate-or-cancel: fills what it can now, the rest is cancelled
+	order_ioc = 'I',
+	// fill-or-kill: fills completely now or not at all
+	order_fok = 'F',
+	// immediate-or-cancel at any price; price is ignored
+	order_market = 'K'
 };
 
 struct ClientCommand
@@ -22,21 +53,40 @@ struct ClientCommand
 	uint32_t price;
 	uint32_t count;
 	char instrument[9];
+	// for buys and sells, in what was padding so zeroed commands stay limits
+	OrderKind kind;
 };
 
+static_assert(sizeof(ClientCommand) == 28);
+
 enum class ReadResult
 {
 	Success,
 	EndOfFile,
-	Error
+	Error,
+	// nonblocking socket with nothing to read yet
+	WouldBlock
 };
 
+// Commands are read from the socket in large chunks and handed out from a
+// buffer; a command split across reads is carried over to the next one.
 struct ClientConnection
 {
+	static constexpr size_t BUFFER_COMMANDS = 256;
+
 	~ClientConnection() { this->freeHandle(); }
-	explicit ClientConnection(int handle) : m_handle(handle) { }
+	explicit ClientConnection(int handle)
+	    : m_handle(handle), m_buffer(new char[BUFFER_COMMANDS * sizeof(ClientCommand)])
+	{
+	}
 
-	ClientConnection(ClientConnection&& other) : m_handle(std::exchange(other.m_handle, -1)) { }
+	ClientConnection(ClientConnection&& other)
+	    : m_handle(std::exchange(other.m_handle, -1)),
+	      m_buffer(std::move(other.m_buffer)),
+	      m_begin(std::exchange(other.m_begin, 0)),
+	      m_end(std::exchange(other.m_end, 0))
+	{
+	}
 	ClientConnection& operator=(ClientConnection&& other)
 	{
 		if(&other == this)
@@ -44,6 +94,9 @@ struct ClientConnection
 
 		this->freeHandle();
 		m_handle = std::exchange(other.m_handle, -1);
+		m_buffer = std::move(other.m_buffer);
+		m_begin = std::exchange(other.m_begin, 0);
+		m_end = std::exchange(other.m_end, 0);
 
 		return *this;
 	}
@@ -53,9 +106,24 @@ struct ClientConnection
 
 	ReadResult readInput(ClientCommand& read_into);
 
+	// Hands out every whole command already buffered, reading once from the
+	// socket first if there are none. The commands stay valid until the next
+	// read call.
+	ReadResult readBatch(std::span<const ClientCommand>& commands);
+
+	int handle() const { return m_handle; }
+	bool setNonBlocking();
+
 private:
 	int m_handle;
+	std::unique_ptr<char[]> m_buffer;
+	// unconsumed bytes are [m_begin, m_end), m_begin is always command aligned
+	size_t m_begin = 0;
+	size_t m_end = 0;
+
 	void freeHandle();
+	size_t buffered() const { return (m_end - m_begin) / sizeof(ClientCommand); }
+	ReadResult fill();
 };
 
 // An implementation of std::osyncstream{std::cout}
@@ -104,8 +172,23 @@ class Output
 {
 public:
 	inline static void
-	OrderAdded(uint32_t id, std::string symbol, uint32_t price, uint32_t count, bool is_sell_side, intmax_t output_timestamp)
+	OrderAdded(uint32_t id, std::string_view symbol, uint32_t price, uint32_t count, bool is_sell_side, intmax_t output_timestamp)
 	{
+		output_timer timer;
+		if(event_writer::running())
+		{
+			output_event e {};
+			e.kind = event_kind::added;
+			e.flag = is_sell_side;
+			e.id = id;
+			e.symbol = pack_symbol(symbol);
+			e.price = price;
+			e.count = count;
+			e.timestamp = output_timestamp;
+			event_writer::emit(e);
+			return;
+		}
+
 		SyncCout()
 		    << (is_sell_side ? "S " : "B ") //
 		    << id << " "                    //
@@ -123,6 +206,21 @@ public:
 	    uint32_t count,
 	    intmax_t output_timestamp)
 	{
+		output_timer timer;
+		if(event_writer::running())
+		{
+			output_event e {};
+			e.kind = event_kind::executed;
+			e.id = resting_id;
+			e.other_id = new_id;
+			e.execution_id = execution_id;
+			e.price = price;
+			e.count = count;
+			e.timestamp = output_timestamp;
+			event_writer::emit(e);
+			return;
+		}
+
 		SyncCout()
 		    << "E "                //
 		    << resting_id << " "   //
@@ -136,6 +234,18 @@ public:
 
 	inline static void OrderDeleted(uint32_t id, bool cancel_accepted, intmax_t output_timestamp)
 	{
+		output_timer timer;
+		if(event_writer::running())
+		{
+			output_event e {};
+			e.kind = event_kind::deleted;
+			e.flag = cancel_accepted;
+			e.id = id;
+			e.timestamp = output_timestamp;
+			event_writer::emit(e);
+			return;
+		}
+
 		SyncCout()
 		    << "X "                            //
 		    << id << " "                       //
@@ -143,4 +253,28 @@ public:
 		    << output_timestamp                //
 		    << std::endl;
 	}
+
+	inline static void OrderAmended(uint32_t id, uint32_t price, uint32_t count, intmax_t output_timestamp)
+	{
+		output_timer timer;
+		if(event_writer::running())
+		{
+			output_event e {};
+			e.kind = event_kind::amended;
+			e.id = id;
+			e.price = price;
+			e.count = count;
+			e.timestamp = output_timestamp;
+			event_writer::emit(e);
+			return;
+		}
+
+		SyncCout()
+		    << "A "             //
+		    << id << " "        //
+		    << price << " "     //
+		    << count << " "     //
+		    << output_timestamp //
+		    << std::endl;
+	}
 };
@@ -0,0 +1,150 @@
+#include "journal.hpp"
+#include "symbol.hpp"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+void commit(journal_record &record) {
+  std::atomic_ref<uint8_t>(record.committed)
+      .store(1, std::memory_order_release);
+}
+
+} // namespace
+
+bool journal_writer::open(const char *path, uint64_t capacity) {
+  int fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  size_t size = sizeof(journal_header) + capacity * sizeof(journal_record);
+  // reserve the blocks now, so running out of disk is an error here rather
+  // than a SIGBUS on some later append
+  int err = posix_fallocate(fd, 0, static_cast<off_t>(size));
+  if (err != 0) {
+    close(fd);
+    errno = err;
+    return false;
+  }
+  void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  map = static_cast<char *>(mapped);
+  map_size = size;
+  records = reinterpret_cast<journal_record *>(map + sizeof(journal_header));
+  this->capacity = capacity;
+  journal_header header{};
+  memcpy(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+  header.capacity = capacity;
+  memcpy(map, &header, sizeof(header));
+  return true;
+}
+
+void journal_writer::sync() {
+  if (map) {
+    msync(map, map_size, MS_SYNC);
+  }
+}
+
+journal_record *journal_writer::reserve() {
+  uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+  if (index >= capacity) {
+    if (!full.exchange(true, std::memory_order_relaxed)) {
+      SyncCerr{} << "Journal full, no longer journaling" << std::endl;
+    }
+    return nullptr;
+  }
+  return records + index;
+}
+
+void journal_writer::append(journal_entry kind, uint32_t connection,
+                            int64_t timestamp, const ClientCommand &command) {
+  journal_record *record = reserve();
+  if (!record) {
+    return;
+  }
+  record->timestamp = timestamp;
+  record->connection = connection;
+  record->kind = kind;
+  memcpy(&record->command, &command, sizeof(command));
+  commit(*record);
+}
+
+void journal_writer::append_cancel_all(uint32_t connection, int64_t timestamp,
+                                       uint64_t symbol) {
+  ClientCommand command{};
+  command.type = input_cancel_all;
+  std::string_view chars = symbol_view(symbol);
+  memcpy(command.instrument, chars.data(), chars.size());
+  append(journal_entry::cancel_all, connection, timestamp, command);
+}
+
+bool journal_reader::open(const char *path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+  auto size = static_cast<size_t>(st.st_size);
+  if (size < sizeof(journal_header)) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  madvise(mapped, size, MADV_SEQUENTIAL);
+
+  auto *map = static_cast<const char *>(mapped);
+  journal_header header;
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0) {
+    munmap(mapped, size);
+    errno = EINVAL;
+    return false;
+  }
+
+  first = reinterpret_cast<const journal_record *>(map + sizeof(header));
+  size_t available = (size - sizeof(header)) / sizeof(journal_record);
+  // everything past the last committed record was never reserved, or was
+  // reserved and lost with the engine
+  size_t end = available;
+  while (end > 0 && !first[end - 1].committed) {
+    end--;
+  }
+  count = 0;
+  while (count < end && first[count].committed) {
+    count++;
+  }
+  if (count == end) {
+    return true;
+  }
+  // appends that were cut off left holes, keep what is around them
+  compacted.assign(first, first + count);
+  for (size_t i = count; i < end; i++) {
+    if (first[i].committed) {
+      compacted.push_back(first[i]);
+    }
+  }
+  SyncCerr{} << "Journal has " << end - compacted.size()
+             << " uncommitted records, skipping them" << std::endl;
+  first = compacted.data();
+  count = compacted.size();
+  return true;
+}
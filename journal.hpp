@@ -0,0 +1,102 @@
+#pragma once
+
+#include "io.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+// Input journal.
+//
+// Every command that reaches a book is appended, with its connection and
+// the time it took effect, to a preallocated memory-mapped file. A command
+// is journaled where it is applied, under its instrument lock or on its
+// shard, so each instrument's records are in the order its book saw them.
+// Replaying the journal in file order rebuilds the same books, and each
+// instrument's events come out in the same order; only how the events of
+// different instruments interleave may differ.
+//
+// Appending is one atomic reservation plus a memcpy. Nothing goes through
+// write(); the kernel writes the pages back on its own, so a crash of the
+// engine loses nothing that was appended. Each record is marked committed
+// once it is filled in. Threads append concurrently, so a crash can leave
+// a few reserved records that were never committed among ones that were;
+// a reader skips those holes and keeps every committed record up to the
+// last one.
+
+constexpr char JOURNAL_MAGIC[8] = {'M', 'E', 'J', 'R', 'N', 'L', '2', 0};
+
+enum class journal_entry : uint8_t {
+  // an order, cancel or amend, as sent
+  command = 1,
+  // a cancel or amend of an id the client had no order for
+  reject = 2,
+  // a mass cancel, or cancel-on-disconnect, reaching one instrument; the
+  // command holds just its symbol
+  cancel_all = 3,
+};
+
+struct journal_header {
+  char magic[8];
+  // records the file has room for
+  uint64_t capacity;
+  uint64_t reserved[6];
+};
+
+struct journal_record {
+  int64_t timestamp;
+  uint32_t connection;
+  journal_entry kind;
+  // set last; a record with this clear was never completely written
+  uint8_t committed;
+  uint16_t reserved;
+  ClientCommand command;
+  uint32_t padding;
+};
+
+static_assert(sizeof(journal_header) == 64);
+static_assert(sizeof(journal_record) == 48);
+
+class journal_writer {
+public:
+  // Creates (or truncates) path with room for capacity records. Returns
+  // false with errno set on failure.
+  bool open(const char *path, uint64_t capacity);
+  // Flushes what has been appended to disk. Appending stays valid.
+  void sync();
+
+  // Call as the command takes effect, holding its instrument (see above).
+  void append(journal_entry kind, uint32_t connection, int64_t timestamp,
+              const ClientCommand &command);
+  void append_cancel_all(uint32_t connection, int64_t timestamp,
+                         uint64_t symbol);
+
+private:
+  char *map = nullptr;
+  size_t map_size = 0;
+  journal_record *records = nullptr;
+  uint64_t capacity = 0;
+  alignas(64) std::atomic<uint64_t> next{0};
+  std::atomic<bool> full{false};
+
+  // next free record, or nullptr once the journal is full
+  journal_record *reserve();
+};
+
+class journal_reader {
+public:
+  // Maps a journal read-only. Returns false with errno set on failure,
+  // EINVAL if it is not a journal.
+  bool open(const char *path);
+  // The committed records, in the order they were appended
+  std::span<const journal_record> records() const {
+    return {first, count};
+  }
+
+private:
+  const journal_record *first = nullptr;
+  size_t count = 0;
+  // the committed records, only when holes had to be left out
+  std::vector<journal_record> compacted;
+};
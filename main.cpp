@@ -1,6 +1,9 @@
 // This file contains main() as well as the logic setting up the I/O.
 // There should be no need to modify this file.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <signal.h>
 #include <stddef.h>
@@ -11,15 +14,78 @@
 #include <unistd.h>
 
 #include "io.hpp"
+#include "affinity.hpp"
+#include "clock.hpp"
 #include "engine.hpp"
+#include "exec_profile.hpp"
+#include "journal.hpp"
+#include "market_data.hpp"
+#include "output.hpp"
 
 static int listenfd = -1;
 static char* socketpath = NULL;
+static volatile sig_atomic_t exit_requested = 0;
+static journal_writer journal;
+static Engine* engine = NULL;
+static const char* snapshot_path = NULL;
 
+// Wakes the accept loop so main can return and run the atexit handlers,
+// including the output flush, outside of signal context.
 static void handle_exit_signal(int signum)
 {
 	(void) signum;
-	exit(0);
+	exit_requested = 1;
+	shutdown(listenfd, SHUT_RDWR);
+}
+
+static void usage(const char* prog)
+{
+	fprintf(stderr,
+	    "Usage: %s [options] <socket path>\n"
+	    "       %s [options] --replay <journal>\n"
+	    "  --sync-output         print each event from the matching thread instead of the writer thread\n"
+	    "  --binary-output       write fixed-width binary event records (see ./decoder)\n"
+	    "  --output-file <path>  write events to <path> instead of stdout\n"
+	    "  --workers <n>         serve connections from n epoll worker threads instead of a thread each\n"
+	    "  --shards <n>          match on n threads, each owning a slice of the instruments\n"
+	    "  --shard-cpus <list>   pin shard threads to these cpus, e.g. 2,3 or 4-7\n"
+	    "  --engine-cpus <list>  pin connection, worker and ring threads to these cpus\n"
+	    "  --housekeeping-cpus <list>  run the accept loop, writer and other helpers on these cpus\n"
+	    "  --busy-poll           spin on nonblocking client sockets before blocking\n"
+	    "  --spin-us <n>         longest a busy-polling thread spins before blocking (default 100)\n"
+	    "  --profile <path>      load the options above from a file, one per line\n"
+	    "  --cancel-on-disconnect  cancel a client's resting orders when it disconnects\n"
+	    "  --stats               collect per-stage latency and counters, dumped to stderr on SIGUSR1\n"
+	    "  --journal <path>      append every command to a memory-mapped journal as it is matched\n"
+	    "  --journal-size <MiB>  space preallocated for the journal (default 256)\n"
+	    "  --replay <journal>    match the commands in a journal instead of listening on a socket\n"
+	    "  --snapshot <path>     write the book to <path> on SIGUSR2 and at exit\n"
+	    "  --restore <path>      load a snapshot into the book before starting\n"
+	    "  --md-feed <path>      publish L2 depth updates to subscribers on this UNIX socket\n"
+	    "  --md-depth <n>        price levels a side on the feed (default 5, at most 32)\n"
+	    "  --book-layout <name>  dense, sparse or adaptive (default) price level storage\n",
+	    prog, prog);
+}
+
+static void stop_output(void)
+{
+	event_writer::stop();
+}
+
+static void sync_journal(void)
+{
+	journal.sync();
+}
+
+static void stop_market_data(void)
+{
+	market_data::stop();
+}
+
+static void exit_snapshot(void)
+{
+	if(!engine->snapshot(snapshot_path))
+		perror("snapshot");
 }
 
 static void exit_cleanup(void)
@@ -32,15 +98,215 @@ static void exit_cleanup(void)
 		unlink(socketpath);
 }
 
+static bool restore(const char* path)
+{
+	if(!path)
+		return true;
+
+	size_t orders = 0;
+	size_t dropped = 0;
+	int64_t start = tsc_clock::now();
+	if(!engine->restore(path, orders, dropped))
+	{
+		perror("restore");
+		return false;
+	}
+	double ms = (double) (tsc_clock::now() - start) / 1e6;
+	fprintf(stderr, "Restored %zu orders in %.3f ms\n", orders, ms);
+	if(dropped)
+		fprintf(stderr, "Left out %zu orders whose ids are not unique\n", dropped);
+	return true;
+}
+
 int main(int argc, char* argv[])
 {
-	if(argc < 2)
+	static const struct option long_options[] = {
+		{ "sync-output", no_argument, NULL, 's' },
+		{ "binary-output", no_argument, NULL, 'b' },
+		{ "output-file", required_argument, NULL, 'o' },
+		{ "workers", required_argument, NULL, 'w' },
+		{ "shards", required_argument, NULL, 'n' },
+		{ "shard-cpus", required_argument, NULL, 'c' },
+		{ "engine-cpus", required_argument, NULL, 'c' },
+		{ "housekeeping-cpus", required_argument, NULL, 'c' },
+		{ "busy-poll", no_argument, NULL, 'c' },
+		{ "spin-us", required_argument, NULL, 'c' },
+		{ "profile", required_argument, NULL, 'P' },
+		{ "cancel-on-disconnect", no_argument, NULL, 'd' },
+		{ "stats", no_argument, NULL, 't' },
+		{ "journal", required_argument, NULL, 'j' },
+		{ "journal-size", required_argument, NULL, 'J' },
+		{ "replay", required_argument, NULL, 'r' },
+		{ "snapshot", required_argument, NULL, 'p' },
+		{ "restore", required_argument, NULL, 'R' },
+		{ "md-feed", required_argument, NULL, 'f' },
+		{ "md-depth", required_argument, NULL, 'D' },
+		{ "book-layout", required_argument, NULL, 'L' },
+		{ NULL, 0, NULL, 0 },
+	};
+
+	bool sync_output = false;
+	output_format format = output_format::text;
+	const char* output_path = NULL;
+	const char* journal_path = NULL;
+	unsigned long journal_mib = 256;
+	const char* replay_path = NULL;
+	const char* restore_path = NULL;
+	const char* md_path = NULL;
+	unsigned md_depth = 5;
+	engine_options options;
+	int opt;
+	int index;
+	while((opt = getopt_long(argc, argv, "", long_options, &index)) != -1)
+	{
+		switch(opt)
+		{
+			case 's': sync_output = true; break;
+			case 'b': format = output_format::binary; break;
+			case 'o': output_path = optarg; break;
+			case 'w': options.workers = (unsigned) strtoul(optarg, NULL, 10); break;
+			case 'n': options.shards = (unsigned) strtoul(optarg, NULL, 10); break;
+			case 'd': options.cancel_on_disconnect = true; break;
+			case 't': options.stats = true; break;
+			case 'j': journal_path = optarg; break;
+			case 'J': journal_mib = strtoul(optarg, NULL, 10); break;
+			case 'r': replay_path = optarg; break;
+			case 'p': snapshot_path = optarg; break;
+			case 'R': restore_path = optarg; break;
+			case 'f': md_path = optarg; break;
+			case 'D': md_depth = (unsigned) strtoul(optarg, NULL, 10); break;
+			case 'L':
+				if(strcmp(optarg, "dense") == 0)
+					options.book_layout = layout_policy::dense;
+				else if(strcmp(optarg, "sparse") == 0)
+					options.book_layout = layout_policy::sparse;
+				else if(strcmp(optarg, "adaptive") == 0)
+					options.book_layout = layout_policy::adaptive;
+				else
+				{
+					fprintf(stderr, "Bad book layout: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'c':
+			{
+				// execution profile options, handled by name
+				const char* value = optarg ? optarg : "";
+				if(!set_profile_option(options.profile, long_options[index].name, value))
+				{
+					fprintf(stderr, "Bad value for --%s: %s\n", long_options[index].name, value);
+					return 1;
+				}
+				break;
+			}
+			case 'P':
+			{
+				unsigned bad_line;
+				if(!load_profile(optarg, options.profile, bad_line))
+				{
+					if(bad_line == 0)
+						perror("profile");
+					else
+						fprintf(stderr, "%s:%u: bad profile option\n", optarg, bad_line);
+					return 1;
+				}
+				break;
+			}
+			default: usage(argv[0]); return 1;
+		}
+	}
+
+	if(optind >= argc && !replay_path)
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	if(journal_path && replay_path)
+	{
+		fprintf(stderr, "--replay does not journal, drop --journal\n");
+		return 1;
+	}
+
+	if(sync_output && format == output_format::binary)
+	{
+		fprintf(stderr, "--binary-output needs the writer thread, drop --sync-output\n");
+		return 1;
+	}
+
+	int outputfd = STDOUT_FILENO;
+	if(output_path)
 	{
-		fprintf(stderr, "Usage: %s <socket path>\n", argv[0]);
+		outputfd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if(outputfd == -1)
+		{
+			perror("open");
+			return 1;
+		}
+		// the synchronous path prints through std::cout
+		if(sync_output && dup2(outputfd, STDOUT_FILENO) == -1)
+		{
+			perror("dup2");
+			return 1;
+		}
+	}
+
+	tsc_clock::init();
+
+	// every thread started from here on inherits this
+	if(!enter_housekeeping(options.profile))
+	{
+		fprintf(stderr, "Could not pin to the housekeeping cpus\n");
 		return 1;
 	}
+	tsc_clock::start_resync();
+
+	options.snapshot_path = snapshot_path;
+	{
+		// only the engine's signal thread takes these, every thread started
+		// from here on inherits the mask
+		sigset_t set = engine_signals(options);
+		pthread_sigmask(SIG_BLOCK, &set, NULL);
+	}
+
+	if(!sync_output)
+	{
+		event_writer::start(outputfd, format);
+		atexit(stop_output);
+	}
+
+	if(md_path)
+	{
+		if(!market_data::start(md_path, md_depth))
+		{
+			perror("md-feed");
+			return 1;
+		}
+		atexit(stop_market_data);
+	}
 
-	socketpath = argv[1];
+	if(replay_path)
+	{
+		journal_reader reader;
+		if(!reader.open(replay_path))
+		{
+			perror("replay");
+			return 1;
+		}
+		auto records = reader.records();
+		engine = new Engine(options);
+		if(!restore(restore_path))
+			return 1;
+		int64_t start = tsc_clock::now();
+		engine->replay(records);
+		double seconds = (double) (tsc_clock::now() - start) / 1e9;
+		fprintf(stderr, "Replayed %zu records in %.3f s\n", records.size(), seconds);
+		if(snapshot_path)
+			atexit(exit_snapshot);
+		return 0;
+	}
+
+	socketpath = argv[optind];
 	listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if(listenfd == -1)
 	{
@@ -51,7 +317,7 @@ int main(int argc, char* argv[])
 	{
 		struct sockaddr_un sockaddr {};
 		sockaddr.sun_family = AF_UNIX;
-		strncpy(sockaddr.sun_path, argv[1], sizeof(sockaddr.sun_path) - 1);
+		strncpy(sockaddr.sun_path, socketpath, sizeof(sockaddr.sun_path) - 1);
 		if(bind(listenfd, (const struct sockaddr*) &sockaddr, sizeof(sockaddr)) != 0)
 		{
 			perror("bind");
@@ -63,18 +329,39 @@ int main(int argc, char* argv[])
 	signal(SIGINT, handle_exit_signal);
 	signal(SIGTERM, handle_exit_signal);
 
-	if(listen(listenfd, 8) != 0)
+	if(listen(listenfd, SOMAXCONN) != 0)
 	{
 		perror("listen");
 		return 1;
 	}
 
-	auto engine = new Engine();
+	if(journal_path)
+	{
+		uint64_t capacity = (journal_mib << 20) / sizeof(journal_record);
+		if(!journal.open(journal_path, capacity))
+		{
+			perror("journal");
+			return 1;
+		}
+		atexit(sync_journal);
+		options.journal = &journal;
+	}
+
+	engine = new Engine(options);
+	if(!restore(restore_path))
+		return 1;
+	if(snapshot_path)
+		atexit(exit_snapshot);
+
 	while(true)
 	{
 		int connfd = accept(listenfd, NULL, NULL);
 		if(connfd == -1)
 		{
+			if(exit_requested)
+				break;
+			if(errno == EINTR)
+				continue;
 			perror("accept");
 			return 1;
 		}
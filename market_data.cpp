@@ -0,0 +1,410 @@
+#include "market_data.hpp"
+#include "mpsc_queue.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace {
+
+// instruments waiting for the publisher; should it ever fill, the
+// publisher rescans every instrument instead
+constexpr size_t QUEUE_CAPACITY = 1 << 16;
+// output generated ahead for a subscriber before waiting for it to drain
+constexpr size_t MAX_PENDING = 64 << 10;
+
+struct depth_state {
+  std::vector<depth_level> bids;
+  std::vector<depth_level> asks;
+};
+
+struct subscriber {
+  int fd;
+  // generated but not yet accepted by the socket
+  std::string out;
+  // instruments changed since this subscriber was last sent them, oldest
+  // first; this is where a slow subscriber's updates are conflated
+  std::deque<market_depth *> dirty;
+  std::unordered_set<market_depth *> is_dirty;
+  // what this subscriber has been sent of each instrument
+  std::unordered_map<market_depth *, depth_state> seen;
+
+  void mark(market_depth *depth) {
+    if (is_dirty.insert(depth).second) {
+      dirty.push_back(depth);
+    }
+  }
+};
+
+unsigned levels = 0;
+int listenfd = -1;
+int wakefd = -1;
+std::string socket_path;
+mpsc_queue<market_depth *> *queue = nullptr;
+std::atomic<bool> overflowed{false};
+std::atomic<bool> sleeping{false};
+// Never destroyed: matching threads and the publisher keep running while
+// the process exits.
+std::mutex &registry_mtx = *new std::mutex;
+std::vector<market_depth *> &registry = *new std::vector<market_depth *>;
+
+// publisher only
+auto &current = *new std::unordered_map<market_depth *, depth_state>;
+auto &subscribers = *new std::vector<subscriber>;
+
+bool same_as_stored(const market_depth &depth,
+                    std::span<const depth_level> bids,
+                    std::span<const depth_level> asks) {
+  if (depth.bid_count.load(std::memory_order_relaxed) != bids.size() ||
+      depth.ask_count.load(std::memory_order_relaxed) != asks.size()) {
+    return false;
+  }
+  auto same = [&](std::span<const depth_level> side, size_t base) {
+    for (size_t i = 0; i < side.size(); i++) {
+      const depth_level &level = side[i];
+      uint64_t key = uint64_t{level.price} << 32 | level.orders;
+      if (depth.words[base + 2 * i].load(std::memory_order_relaxed) != key ||
+          depth.words[base + 2 * i + 1].load(std::memory_order_relaxed) !=
+              level.quantity) {
+        return false;
+      }
+    }
+    return true;
+  };
+  return same(bids, 0) && same(asks, 2 * MAX_MD_DEPTH);
+}
+
+void store(market_depth &depth, std::span<const depth_level> bids,
+           std::span<const depth_level> asks) {
+  uint32_t s = depth.seq.load(std::memory_order_relaxed);
+  depth.seq.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  auto put = [&](std::span<const depth_level> side, size_t base) {
+    for (size_t i = 0; i < side.size(); i++) {
+      const depth_level &level = side[i];
+      depth.words[base + 2 * i].store(uint64_t{level.price} << 32 |
+                                          level.orders,
+                                      std::memory_order_relaxed);
+      depth.words[base + 2 * i + 1].store(level.quantity,
+                                          std::memory_order_relaxed);
+    }
+  };
+  put(bids, 0);
+  put(asks, 2 * MAX_MD_DEPTH);
+  depth.bid_count.store(static_cast<uint32_t>(bids.size()),
+                        std::memory_order_relaxed);
+  depth.ask_count.store(static_cast<uint32_t>(asks.size()),
+                        std::memory_order_relaxed);
+  depth.seq.store(s + 2, std::memory_order_release);
+}
+
+depth_state load(const market_depth &depth) {
+  depth_state state;
+  while (true) {
+    uint32_t s = depth.seq.load(std::memory_order_acquire);
+    size_t bids = std::min<size_t>(
+        depth.bid_count.load(std::memory_order_relaxed), MAX_MD_DEPTH);
+    size_t asks = std::min<size_t>(
+        depth.ask_count.load(std::memory_order_relaxed), MAX_MD_DEPTH);
+    auto get = [&](std::vector<depth_level> &side, size_t n, size_t base) {
+      side.resize(n);
+      for (size_t i = 0; i < n; i++) {
+        uint64_t key =
+            depth.words[base + 2 * i].load(std::memory_order_relaxed);
+        uint64_t quantity =
+            depth.words[base + 2 * i + 1].load(std::memory_order_relaxed);
+        side[i] = {static_cast<uint32_t>(key >> 32),
+                   static_cast<uint32_t>(key), quantity};
+      }
+    };
+    get(state.bids, bids, 0);
+    get(state.asks, asks, 2 * MAX_MD_DEPTH);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (!(s & 1) && depth.seq.load(std::memory_order_relaxed) == s) {
+      return state;
+    }
+  }
+}
+
+void wake() {
+  // pairs with the fence in publisher: either it sees the queued
+  // instrument before it sleeps, or we see it asleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping.load(std::memory_order_relaxed)) {
+    sleeping.store(false, std::memory_order_relaxed);
+    uint64_t one = 1;
+    [[maybe_unused]] ssize_t n = write(wakefd, &one, sizeof(one));
+  }
+}
+
+void append_level(std::string &out, char side, uint32_t price,
+                  uint64_t quantity, uint32_t orders) {
+  char line[64];
+  int n = snprintf(line, sizeof(line), "%c %u %lu %u\n", side, price,
+                   static_cast<unsigned long>(quantity), orders);
+  out.append(line, static_cast<size_t>(n));
+}
+
+// Appends the levels of after that differ from before, and a removal for
+// each level of before that is gone; returns how many lines it wrote
+size_t diff_side(char side, const std::vector<depth_level> &before,
+                 const std::vector<depth_level> &after, std::string &out) {
+  size_t lines = 0;
+  for (const depth_level &level : before) {
+    auto kept = std::find_if(after.begin(), after.end(), [&](auto &other) {
+      return other.price == level.price;
+    });
+    if (kept == after.end()) {
+      append_level(out, side, level.price, 0, 0);
+      lines++;
+    }
+  }
+  for (const depth_level &level : after) {
+    auto old = std::find_if(before.begin(), before.end(), [&](auto &other) {
+      return other.price == level.price;
+    });
+    if (old == before.end() || !(*old == level)) {
+      append_level(out, side, level.price, level.quantity, level.orders);
+      lines++;
+    }
+  }
+  return lines;
+}
+
+// Appends the next message for depth to sub's output, a full state if it
+// has never been sent the instrument
+void send_update(subscriber &sub, market_depth *depth) {
+  const depth_state &now = current[depth];
+  auto seen = sub.seen.find(depth);
+  bool full = seen == sub.seen.end();
+  static const depth_state empty;
+  const depth_state &before = full ? empty : seen->second;
+
+  std::string body;
+  size_t lines = diff_side('B', before.bids, now.bids, body) +
+                 diff_side('S', before.asks, now.asks, body);
+  if (lines == 0 && !full) {
+    return;
+  }
+  char header[64];
+  int n = snprintf(header, sizeof(header), "%c %.*s %zu\n", full ? 'R' : 'U',
+                   static_cast<int>(symbol_view(depth->symbol).size()),
+                   symbol_view(depth->symbol).data(), lines);
+  sub.out.append(header, static_cast<size_t>(n));
+  sub.out += body;
+  sub.seen[depth] = now;
+}
+
+// Generates and writes what sub is owed until it is up to date or its
+// socket is full. Returns false if the subscriber has gone away.
+bool flush(subscriber &sub) {
+  while (true) {
+    while (sub.out.size() < MAX_PENDING && !sub.dirty.empty()) {
+      market_depth *depth = sub.dirty.front();
+      sub.dirty.pop_front();
+      sub.is_dirty.erase(depth);
+      send_update(sub, depth);
+    }
+    if (sub.out.empty()) {
+      return true;
+    }
+    ssize_t n = send(sub.fd, sub.out.data(), sub.out.size(),
+                     MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (n < 0) {
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+    sub.out.erase(0, static_cast<size_t>(n));
+  }
+}
+
+void publish(market_depth *depth) {
+  // an acq_rel exchange reads the owner's latest queueing, so the levels it
+  // stored before queueing are visible to the load below
+  depth->queued.exchange(false, std::memory_order_acq_rel);
+  depth_state now = load(*depth);
+  auto [last, added] = current.try_emplace(depth);
+  if (!added && last->second.bids == now.bids &&
+      last->second.asks == now.asks) {
+    return;
+  }
+  last->second = std::move(now);
+  for (subscriber &sub : subscribers) {
+    sub.mark(depth);
+  }
+}
+
+void drain_queue() {
+  market_depth *depth;
+  while (queue->try_pop(depth)) {
+    publish(depth);
+  }
+  if (overflowed.exchange(false, std::memory_order_relaxed)) {
+    std::vector<market_depth *> all;
+    {
+      std::unique_lock<std::mutex> lock(registry_mtx);
+      all = registry;
+    }
+    for (market_depth *depth : all) {
+      publish(depth);
+    }
+  }
+}
+
+void accept_subscribers() {
+  while (true) {
+    int fd = accept4(listenfd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      return;
+    }
+    subscriber &sub = subscribers.emplace_back();
+    sub.fd = fd;
+    for (auto &[depth, state] : current) {
+      sub.mark(depth);
+    }
+  }
+}
+
+void publisher() {
+  std::vector<pollfd> fds;
+  while (true) {
+    drain_queue();
+    for (size_t i = 0; i < subscribers.size();) {
+      if (!flush(subscribers[i])) {
+        close(subscribers[i].fd);
+        subscribers[i] = std::move(subscribers.back());
+        subscribers.pop_back();
+        continue;
+      }
+      i++;
+    }
+
+    sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    market_depth *depth;
+    if (queue->try_pop(depth)) {
+      sleeping.store(false, std::memory_order_relaxed);
+      publish(depth);
+      continue;
+    }
+    if (overflowed.load(std::memory_order_relaxed)) {
+      sleeping.store(false, std::memory_order_relaxed);
+      continue;
+    }
+
+    fds.clear();
+    fds.push_back({wakefd, POLLIN, 0});
+    fds.push_back({listenfd, POLLIN, 0});
+    for (const subscriber &sub : subscribers) {
+      // hangups are always reported
+      fds.push_back({sub.fd, static_cast<short>(sub.out.empty() ? 0 : POLLOUT),
+                     0});
+    }
+    int ready = poll(fds.data(), fds.size(), -1);
+    sleeping.store(false, std::memory_order_relaxed);
+    if (ready <= 0) {
+      continue;
+    }
+    if (fds[0].revents & POLLIN) {
+      uint64_t count;
+      [[maybe_unused]] ssize_t n = read(wakefd, &count, sizeof(count));
+    }
+    // back to front, so removing one leaves the others' indices alone
+    for (size_t i = subscribers.size(); i-- > 0;) {
+      if (fds[i + 2].revents & (POLLHUP | POLLERR)) {
+        close(subscribers[i].fd);
+        subscribers[i] = std::move(subscribers.back());
+        subscribers.pop_back();
+      }
+    }
+    if (fds[1].revents & POLLIN) {
+      accept_subscribers();
+    }
+  }
+}
+
+} // namespace
+
+bool market_data::start(const char *path, unsigned depth) {
+  levels = std::min<unsigned>(std::max(depth, 1u), MAX_MD_DEPTH);
+  listenfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listenfd == -1) {
+    return false;
+  }
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+  if (bind(listenfd, reinterpret_cast<const sockaddr *>(&addr),
+           sizeof(addr)) != 0 ||
+      listen(listenfd, SOMAXCONN) != 0) {
+    close(listenfd);
+    return false;
+  }
+  socket_path = path;
+  wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (wakefd == -1) {
+    return false;
+  }
+  queue = new mpsc_queue<market_depth *>(QUEUE_CAPACITY);
+  active.store(true, std::memory_order_relaxed);
+  std::thread(publisher).detach();
+  return true;
+}
+
+void market_data::stop() {
+  if (socket_path.empty()) {
+    return;
+  }
+  close(listenfd);
+  unlink(socket_path.c_str());
+  socket_path.clear();
+}
+
+void market_data::update(instrument &instrument) {
+  market_depth *depth = instrument.depth;
+  if (!depth) {
+    depth = new market_depth(instrument.symbol);
+    {
+      std::unique_lock<std::mutex> lock(registry_mtx);
+      registry.push_back(depth);
+    }
+    instrument.depth = depth;
+  }
+
+  depth_level bids[MAX_MD_DEPTH];
+  depth_level asks[MAX_MD_DEPTH];
+  size_t bid_count = 0;
+  size_t ask_count = 0;
+  instrument.with_book([&](const auto &book) {
+    bid_count = book.buys.depth(std::span(bids, levels));
+    ask_count = book.sells.depth(std::span(asks, levels));
+  });
+  std::span<const depth_level> top_bids(bids, bid_count);
+  std::span<const depth_level> top_asks(asks, ask_count);
+  if (same_as_stored(*depth, top_bids, top_asks)) {
+    // the change was below the published depth
+    return;
+  }
+  store(*depth, top_bids, top_asks);
+  if (depth->queued.exchange(true, std::memory_order_acq_rel)) {
+    // the publisher has not got to the last change yet, and will see this
+    return;
+  }
+  if (!queue->try_push(depth)) {
+    overflowed.store(true, std::memory_order_relaxed);
+  }
+  wake();
+}
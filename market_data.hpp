@@ -0,0 +1,68 @@
+#pragma once
+
+#include "order_book.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Incremental L2 market data feed, on when --md-feed is given.
+//
+// Whoever owns an instrument (the thread holding its lock, or its shard)
+// re-aggregates the top levels of both sides after every change and, if they
+// differ from what it last stored, writes them into the instrument's
+// market_depth under a seqlock and queues the instrument for the publisher.
+// An instrument is queued at most once until the publisher gets to it, so
+// however far the publisher falls behind it only ever sees the latest state
+// of each instrument. The publisher diffs that against what it last sent and
+// writes only the changed levels to every subscriber. A subscriber too slow
+// to drain its socket builds no backlog: the instruments that changed since
+// it was last written to are kept as a set, and each gets one diff against
+// what that subscriber was last sent once its socket has room again.
+// Nothing on the feed side ever waits on, or slows, matching.
+//
+// Subscribers connect to the feed's UNIX socket and read text:
+//   R <symbol> <n>             full state of the instrument follows
+//   U <symbol> <n>             n changed levels follow
+//   B|S <price> <qty> <orders> a level; qty 0 means the level is gone
+// The levels of one R or U message together are a consistent book.
+
+constexpr size_t MAX_MD_DEPTH = 32;
+
+// An instrument's published depth; levels are written only by its owner
+struct market_depth {
+  const uint64_t symbol;
+  // set while queued for the publisher
+  std::atomic<bool> queued{false};
+  // seqlock over everything below, odd while the owner rewrites it
+  std::atomic<uint32_t> seq{0};
+  std::atomic<uint32_t> bid_count{0};
+  std::atomic<uint32_t> ask_count{0};
+  // bids then asks, two words a level: price << 32 | orders, then quantity
+  std::atomic<uint64_t> words[4 * MAX_MD_DEPTH];
+
+  explicit market_depth(uint64_t symbol) : symbol(symbol) {}
+};
+
+class market_data {
+public:
+  // Listens for subscribers on a UNIX socket at path and starts the
+  // publisher, with depth levels a side. Call before any book changes.
+  // Returns false with errno set on failure.
+  static bool start(const char *path, unsigned depth);
+  // Stops listening and removes the socket.
+  static void stop();
+  static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+  // Republishes instrument's depth if the feed is on. The caller must own
+  // the instrument, as for order_book's _unlocked calls.
+  static void book_changed(instrument &instrument) {
+    if (enabled()) {
+      update(instrument);
+    }
+  }
+
+private:
+  static inline std::atomic<bool> active = false;
+
+  static void update(instrument &instrument);
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded multi-producer single-consumer queue (Vyukov's bounded queue with
+// a single consumer). Every cell carries a sequence number that tells
+// producers when it is free and the consumer when it is filled, so producers
+// only contend on the enqueue cursor and never block each other. Items from
+// one producer come out in the order that producer pushed them.
+template <typename T> class mpsc_queue {
+public:
+  // capacity must be a power of two
+  explicit mpsc_queue(size_t capacity)
+      : mask(capacity - 1), cells(new cell[capacity]) {
+    for (size_t i = 0; i < capacity; i++) {
+      cells[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  // false if the queue is full
+  bool try_push(const T &item) {
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      cell &c = cells[pos & mask];
+      size_t seq = c.seq.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          c.item = item;
+          c.seq.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // consumer only
+  bool try_pop(T &item) {
+    cell &c = cells[dequeue_pos & mask];
+    size_t seq = c.seq.load(std::memory_order_acquire);
+    if (seq != dequeue_pos + 1) {
+      return false;
+    }
+    item = c.item;
+    c.seq.store(dequeue_pos + mask + 1, std::memory_order_release);
+    dequeue_pos++;
+    return true;
+  }
+
+private:
+  struct alignas(64) cell {
+    std::atomic<size_t> seq;
+    T item;
+  };
+
+  const size_t mask;
+  std::unique_ptr<cell[]> cells;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) size_t dequeue_pos = 0;
+};
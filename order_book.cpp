@@ -1,138 +1,429 @@
 #include "order_book.hpp"
 #include "engine.hpp"
 #include "io.hpp"
+#include "market_data.hpp"
+#include "stats.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cstdint>
+#include <tuple>
+#include <vector>
 
-bool price_matched(std::shared_ptr<order> active_order,
-                   std::shared_ptr<order> best_order) {
-  return active_order->type == BUY ? active_order->price >= best_order->price
-                                   : active_order->price <= best_order->price;
+#include <sys/mman.h>
+
+std::unique_lock<std::mutex> lock_instrument(instrument &instrument) {
+  if (!stats::enabled()) {
+    return std::unique_lock<std::mutex>(instrument.mtx);
+  }
+  int64_t start = tsc_clock::now();
+  std::unique_lock<std::mutex> lock(instrument.mtx, std::try_to_lock);
+  if (!lock.owns_lock()) {
+    stats::count(counter::lock_contended);
+    lock.lock();
+  }
+  stats::record(stage::lock_wait, tsc_clock::now() - start);
+  return lock;
+}
+
+price_level *allocate_level_window() {
+  // anonymous pages read as zero, an empty level, until first written
+  void *p = mmap(nullptr, price_bitmap::SIZE * sizeof(price_level),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) {
+    return nullptr;
+  }
+  return static_cast<price_level *>(p);
 }
 
-template <typename PQ>
-void add_order_helper(PQ &pq, std::shared_ptr<order> order) {
+void free_level_window(price_level *window) {
+  if (window) {
+    munmap(window, price_bitmap::SIZE * sizeof(price_level));
+  }
+}
+
+template <typename Side> void add_order_helper(Side &side, order *order) {
   bool is_sell = order->type == SELL;
   // the instant at which the order was added to the order book
   uintmax_t output_time = getCurrentTimestamp();
   order->timestamp = output_time;
-  pq.insert(order);
-  Output::OrderAdded(order->id, order->instrument, order->price, order->count,
+  side.push(order);
+  Output::OrderAdded(order->id, order->symbol(), order->price, order->count,
                      is_sell, output_time);
 }
 
-void order_book::add_order(std::shared_ptr<order> active_order) {
-  std::shared_ptr<instrument> instrument = book.get(active_order->instrument);
-  if (active_order->type == BUY) {
-    add_order_helper(*instrument->buy_pq, active_order);
+// Removes a resting order from whichever side of book holds it
+template <typename Book> void erase_order(Book &book, order *order) {
+  if (order->type == BUY) {
+    book.buys.erase(order);
   } else {
-    add_order_helper(*instrument->sell_pq, active_order);
+    book.sells.erase(order);
   }
 }
 
-template <typename PQ>
-bool try_fill_order(PQ &pq, std::shared_ptr<order> active_order) {
-  while (active_order->available() && !pq.empty()) {
+template <typename Side> bool try_fill_order(Side &side, order *active_order) {
+  // decided before touching the book, so a kill leaves it as it was
+  if (active_order->tif == time_in_force::fill_or_kill &&
+      !side.can_fill(active_order->price, active_order->count)) {
+    return false;
+  }
+
+  while (active_order->available() && !side.empty()) {
     // if we are able to get the order, it is guaranteed to be available
-    std::shared_ptr<order> best_order = *pq.begin();
+    order *best_order = side.best();
 
-    // price is read-only, so we don't need to lock the best order
-    if (!price_matched(active_order, best_order)) {
+    if (!Side::crossed_by(active_order->price, best_order->price)) {
       break;
     }
 
     // instant at which the AO was matched with the best order and
     // the order book was updated
     uintmax_t output_time = getCurrentTimestamp();
-    uintmax_t m = std::min(active_order->count, best_order->count);
+    uint32_t m = std::min(active_order->count, best_order->count);
     assert(m > 0);
     active_order->count -= m;
-    best_order->count -= m;
+    side.fill_best(m);
     Output::OrderExecuted(best_order->id, active_order->id,
                           best_order->execution_id, best_order->price, m,
                           output_time);
+    stats::count(counter::fills);
     best_order->execution_id++;
 
-    assert(best_order->count >= 0);
     if (best_order->count == 0) {
-      // this should succeed since we are the first
-      // to see count == 0
-      assert(pq.erase(best_order));
+      // the best order is always at the front of the best level
+      side.pop_best();
+      release_order(best_order);
     }
   }
 
-  assert(active_order->count >= 0);
   return active_order->count == 0;
 }
 
-void order_book::find_match(std::shared_ptr<order> active_order) {
-  if (!book.contains(active_order->instrument)) {
-    book.try_insert(active_order->instrument, std::make_shared<instrument>());
+instrument::instrument(uint64_t symbol, layout_policy policy)
+    : symbol(symbol), layout(book_layout::sparse),
+      has_windows(policy != layout_policy::sparse &&
+                  dense.buys.storage().map_window() &&
+                  dense.sells.storage().map_window()) {
+  if (policy == layout_policy::dense && has_windows) {
+    layout = book_layout::dense;
   }
+}
 
-  std::shared_ptr<instrument> instrument = book.get(active_order->instrument);
-  std::unique_lock<std::mutex> lock(instrument->mtx);
-  bool fully_filled = false;
-  if (active_order->type == SELL) {
-    fully_filled = try_fill_order(*instrument->buy_pq, active_order);
-  } else {
-    fully_filled = try_fill_order(*instrument->sell_pq, active_order);
-  }
+instrument *order_book::resolve(uint64_t symbol) {
+  return book.get_or_insert(symbol, [this, symbol] {
+    std::unique_lock<std::mutex> lock(instruments_mtx);
+    return &instruments.emplace_back(symbol, policy);
+  });
+}
 
-  if (!fully_filled) {
-    add_order(active_order);
-  }
+void order_book::find_match(instrument &instrument, order *active_order) {
+  auto lock = lock_instrument(instrument);
+  find_match_unlocked(instrument, active_order);
 }
 
-void order_book::cancel_order(std::shared_ptr<order> order) {
+void order_book::find_match_unlocked(instrument &instrument,
+                                     order *active_order) {
+  match_timer timer;
+  instrument.with_book([&](auto &book) {
+    bool fully_filled = active_order->type == SELL
+                            ? try_fill_order(book.buys, active_order)
+                            : try_fill_order(book.sells, active_order);
+    if (fully_filled) {
+      release_order(active_order);
+    } else if (active_order->tif != time_in_force::good_till_cancel) {
+      // the remainder never rests; report it cancelled
+      Output::OrderDeleted(active_order->id, true, getCurrentTimestamp());
+      release_order(active_order);
+    } else if (active_order->type == BUY) {
+      add_order_helper(book.buys, active_order);
+    } else {
+      add_order_helper(book.sells, active_order);
+    }
+  });
+  adapt_layout(instrument);
+  market_data::book_changed(instrument);
+}
+
+void order_book::cancel_order(uint32_t order_id, const order_ref &ref) {
+  auto lock = lock_instrument(*ref.instr);
+  cancel_order_unlocked(order_id, ref);
+}
+
+void order_book::cancel_order_unlocked(uint32_t order_id,
+                                       const order_ref &ref) {
+  match_timer timer;
   bool accepted = false;
-  std::shared_ptr<instrument> instrument = book.get(order->instrument);
-  std::unique_lock<std::mutex> lock(instrument->mtx);
-  intmax_t output_time = getCurrentTimestamp();
-  if (order->available()) {
-    order->cancelled = true;
+  // a live order that has been through find_match is always resting
+  if (ref.live()) {
+    order *order = ref.ptr;
     accepted = true;
-    if (order->type == BUY && instrument->buy_pq->contains(order)) {
-      output_time = getCurrentTimestamp();
-      instrument->buy_pq->erase(order);
-    } else if (order->type == SELL && instrument->sell_pq->contains(order)) {
-      output_time = getCurrentTimestamp();
-      instrument->sell_pq->erase(order);
-    }
+    ref.instr->with_book([&](auto &book) { erase_order(book, order); });
+    release_order(order);
+    market_data::book_changed(*ref.instr);
   }
+  stats::count(accepted ? counter::cancels : counter::rejects);
   // instant that cancel was accepted or rejected
-  Output::OrderDeleted(order->id, accepted, output_time);
+  Output::OrderDeleted(order_id, accepted, getCurrentTimestamp());
 }
 
-// Debugging functions
-void order_book::print_instr_top(const std::string &instrument_str) {
-  if (!book.contains(instrument_str)) {
-    std::cerr << "instrument not found: " << instrument_str << std::endl;
+template <typename Side, typename Opposite>
+void amend_helper(Side &side, Opposite &opposite, order *order, uint32_t price,
+                  uint32_t count) {
+  // the instant at which the amend took effect
+  uintmax_t output_time = getCurrentTimestamp();
+  if (price == order->price && count <= order->count) {
+    side.reduce(order, count);
+    Output::OrderAmended(order->id, price, count, output_time);
     return;
   }
-  std::shared_ptr<instrument> instrument = book.get(instrument_str);
-  std::shared_ptr<max_pq> max_pq = instrument->buy_pq;
-  if (max_pq->empty()) {
-    std::cerr << instrument_str << " BUY  top: empty" << std::endl;
+
+  // loses its priority: taken out and sent through matching again
+  side.erase(order);
+  order->price = price;
+  order->count = count;
+  order->timestamp = output_time;
+  Output::OrderAmended(order->id, price, count, output_time);
+  if (try_fill_order(opposite, order)) {
+    release_order(order);
   } else {
-    std::cerr << instrument_str << " BUY  top: " << *max_pq->begin()
-              << std::endl;
+    side.push(order);
+  }
+}
+
+void order_book::amend_order(uint32_t order_id, const order_ref &ref,
+                             uint32_t price, uint32_t count) {
+  auto lock = lock_instrument(*ref.instr);
+  amend_order_unlocked(order_id, ref, price, count);
+}
+
+void order_book::amend_order_unlocked(uint32_t order_id, const order_ref &ref,
+                                      uint32_t price, uint32_t count) {
+  if (count == 0) {
+    cancel_order_unlocked(order_id, ref);
+    return;
+  }
+  match_timer timer;
+  if (!ref.live()) {
+    // already filled or cancelled, reported as for a cancel
+    stats::count(counter::rejects);
+    Output::OrderDeleted(order_id, false, getCurrentTimestamp());
+    return;
+  }
+  order *order = ref.ptr;
+  ref.instr->with_book([&](auto &book) {
+    if (order->type == BUY) {
+      amend_helper(book.buys, book.sells, order, price, count);
+    } else {
+      amend_helper(book.sells, book.buys, order, price, count);
+    }
+  });
+  stats::count(counter::amends);
+  adapt_layout(*ref.instr);
+  market_data::book_changed(*ref.instr);
+}
+
+// A dense book with more levels than this outside its windows goes sparse
+constexpr size_t SPARSE_OVERFLOW_LEVELS = 64;
+// A sparse book goes dense once it holds more orders than this, with every
+// level within DENSE_SPAN of the best price on its side. Thin books stay
+// sparse and never touch their windows.
+constexpr uint32_t DENSE_ORDERS = 64;
+constexpr uint32_t DENSE_SPAN = price_bitmap::SIZE / 2;
+
+// Moves every order of from to to, keeping time priority
+template <typename From, typename To> void move_side(From &from, To &to) {
+  while (!from.empty()) {
+    order *order = from.best();
+    from.pop_best();
+    to.push(order);
+  }
+}
+
+void order_book::adapt_layout(instrument &instrument) {
+  if (policy != layout_policy::adaptive) {
+    return;
   }
-  std::shared_ptr<min_pq> min_pq = instrument->sell_pq;
-  if (min_pq->empty()) {
-    std::cerr << instrument_str << " SELL top: empty" << std::endl;
+  if (instrument.layout == book_layout::dense) {
+    const dense_book &book = instrument.dense;
+    if (book.buys.storage().overflow_levels() +
+            book.sells.storage().overflow_levels() <=
+        SPARSE_OVERFLOW_LEVELS) {
+      return;
+    }
+    move_side(instrument.dense.buys, instrument.sparse.buys);
+    move_side(instrument.dense.sells, instrument.sparse.sells);
+    instrument.layout = book_layout::sparse;
   } else {
-    std::cerr << instrument_str << " SELL top: " << *min_pq->begin()
-              << std::endl;
+    const sparse_book &book = instrument.sparse;
+    if (!instrument.has_windows || book.size() <= DENSE_ORDERS ||
+        book.buys.storage().span() >= DENSE_SPAN ||
+        book.sells.storage().span() >= DENSE_SPAN) {
+      return;
+    }
+    move_side(instrument.sparse.buys, instrument.dense.buys);
+    move_side(instrument.sparse.sells, instrument.dense.sells);
+    instrument.layout = book_layout::dense;
+  }
+  stats::count(counter::layout_switches);
+}
+
+void order_book::cancel_all(instrument &instrument,
+                            std::span<const owned_order> orders) {
+  auto lock = lock_instrument(instrument);
+  cancel_all_unlocked(instrument, orders);
+}
+
+void order_book::cancel_all_unlocked(instrument &instrument,
+                                     std::span<const owned_order> orders) {
+  match_timer timer;
+  for (const owned_order &owned : orders) {
+    if (!owned.ref.live()) {
+      continue;
+    }
+    order *order = owned.ref.ptr;
+    instrument.with_book([&](auto &book) { erase_order(book, order); });
+    release_order(order);
+    stats::count(counter::cancels);
+    Output::OrderDeleted(owned.id, true, getCurrentTimestamp());
+  }
+  market_data::book_changed(instrument);
+}
+
+void order_book::run_batch(instrument &instrument,
+                           std::span<const book_op> ops) {
+  auto lock = lock_instrument(instrument);
+  run_batch_unlocked(instrument, ops);
+}
+
+void order_book::run_batch_unlocked(instrument &instrument,
+                                    std::span<const book_op> ops) {
+  for (const book_op &op : ops) {
+    switch (op.action) {
+    case book_action::match:
+      find_match_unlocked(instrument, op.ref.ptr);
+      break;
+    case book_action::cancel:
+      cancel_order_unlocked(op.order_id, op.ref);
+      break;
+    case book_action::amend:
+      amend_order_unlocked(op.order_id, op.ref, op.price, op.count);
+      break;
+    }
   }
 }
 
+// Debugging functions
+void order_book::print_instr_top(const std::string &instrument_str) {
+  uint64_t key = pack_symbol(instrument_str);
+  if (!book.contains(key)) {
+    std::cerr << "instrument not found: " << instrument_str << std::endl;
+    return;
+  }
+  book.get(key)->with_book([&](const auto &sides) {
+    if (sides.buys.empty()) {
+      std::cerr << instrument_str << " BUY  top: empty" << std::endl;
+    } else {
+      std::cerr << instrument_str << " BUY  top: " << *sides.buys.best()
+                << std::endl;
+    }
+    if (sides.sells.empty()) {
+      std::cerr << instrument_str << " SELL top: empty" << std::endl;
+    } else {
+      std::cerr << instrument_str << " SELL top: " << *sides.sells.best()
+                << std::endl;
+    }
+  });
+}
+
 void order_book::print_all_top() {
-  std::vector<std::string> instruments = book.keys();
+  std::vector<uint64_t> instruments = book.keys();
   std::cerr << "===============================" << std::endl;
   std::cerr << "Printing top of all instruments" << std::endl;
-  for (const std::string &instrument : instruments) {
-    print_instr_top(instrument);
+  for (const uint64_t &instrument : instruments) {
+    print_instr_top(std::string(symbol_view(instrument)));
   }
   std::cerr << "===============================" << std::endl;
 }
+
+void order_book::print_resting(std::ostream &os, size_t limit) {
+  // symbol, buys, sells
+  std::vector<std::tuple<uint64_t, uint32_t, uint32_t>> counts;
+  {
+    std::unique_lock<std::mutex> lock(instruments_mtx);
+    for (instrument &instrument : instruments) {
+      counts.emplace_back(instrument.symbol, instrument.buy_count(),
+                          instrument.sell_count());
+    }
+  }
+  auto total = [](const auto &c) { return std::get<1>(c) + std::get<2>(c); };
+  std::sort(counts.begin(), counts.end(),
+            [&](const auto &a, const auto &b) { return total(a) > total(b); });
+  uint64_t resting = 0;
+  for (const auto &c : counts) {
+    resting += total(c);
+  }
+  os << "resting " << resting << " orders in " << counts.size()
+     << " instruments\n";
+  for (size_t i = 0; i < counts.size() && i < limit; i++) {
+    auto [symbol, buys, sells] = counts[i];
+    os << "  " << symbol_view(symbol) << " buys " << buys << " sells " << sells
+       << '\n';
+  }
+  os.flush();
+}
+
+std::vector<instrument *> order_book::all_instruments() {
+  std::unique_lock<std::mutex> lock(instruments_mtx);
+  std::vector<instrument *> all;
+  all.reserve(instruments.size());
+  for (instrument &instrument : instruments) {
+    all.push_back(&instrument);
+  }
+  return all;
+}
+
+void order_book::snapshot_unlocked(instrument &instrument,
+                                   std::vector<snapshot_order> &out) {
+  auto save = [&](const order &order) {
+    snapshot_order record{};
+    record.symbol = instrument.symbol;
+    record.timestamp = static_cast<int64_t>(order.timestamp);
+    record.id = order.id;
+    record.price = order.price;
+    record.count = order.count;
+    record.execution_id = order.execution_id;
+    record.is_sell = order.type == SELL;
+    out.push_back(record);
+  };
+  instrument.with_book([&](const auto &book) {
+    book.buys.for_each(save);
+    book.sells.for_each(save);
+  });
+}
+
+void order_book::restore(std::span<const snapshot_order> orders,
+                         std::vector<owned_order> &restored) {
+  instrument *instr = nullptr;
+  for (const snapshot_order &record : orders) {
+    if (!instr || instr->symbol != record.symbol) {
+      instr = resolve(record.symbol);
+    }
+    order *order = order_pool::instance().acquire();
+    order->reset(record.id, record.symbol, record.price, record.count,
+                 record.is_sell ? SELL : BUY,
+                 static_cast<uintmax_t>(record.timestamp));
+    order->execution_id = record.execution_id;
+    restored.push_back(
+        {record.id,
+         {order, order->generation.load(std::memory_order_relaxed), instr}});
+    std::unique_lock<std::mutex> lock(instr->mtx);
+    instr->with_book([&](auto &book) {
+      if (record.is_sell) {
+        book.sells.push(order);
+      } else {
+        book.buys.push(order);
+      }
+    });
+    adapt_layout(*instr);
+    market_data::book_changed(*instr);
+  }
+}
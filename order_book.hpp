@@ -1,93 +1,547 @@
 #pragma once
 
 #include "hashmap/hash_map.hpp"
-#include <memory>
+#include "order_pool.hpp"
+#include "price_bitmap.hpp"
+#include "snapshot.hpp"
+#include "symbol.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
 #include <mutex>
 #include <ostream>
-#include <set>
+#include <span>
+#include <string_view>
+#include <vector>
 
 enum order_type { BUY, SELL };
 
+// how long an order may stay in the book
+enum class time_in_force : uint8_t {
+  // rests until filled or cancelled
+  good_till_cancel,
+  // whatever does not fill on arrival is cancelled
+  immediate_or_cancel,
+  // fills completely on arrival or is cancelled untouched
+  fill_or_kill,
+};
+
+struct price_level;
+struct market_depth;
+
 class order {
 public:
-  uintmax_t id;
-  std::string instrument;
-  uintmax_t price;
-  uintmax_t count;
+  uint32_t id;
+  uint32_t price;
+  uint32_t count;
+  uint32_t execution_id;
   order_type type;
+  time_in_force tif;
   uintmax_t timestamp;
-  uintmax_t execution_id;
-  bool cancelled;
+  // packed symbol, see symbol.hpp
+  uint64_t instrument;
+  // intrusive links within its price level, only valid while resting
+  order *prev;
+  order *next;
+  price_level *level;
+  bool resting;
+  // bumped every time the order goes back to the pool
+  std::atomic<uint32_t> generation{0};
 
-  order(uintmax_t id, const char *instrument, uintmax_t price, uintmax_t count,
-        order_type type, uintmax_t timestamp)
-      : id(id), instrument(std::string(instrument)), price(price), count(count),
-        type(type), timestamp(timestamp), execution_id(1), cancelled(false) {}
+  // (re)initialise a pooled order, keeping its generation
+  void reset(uint32_t id, uint64_t instrument, uint32_t price, uint32_t count,
+             order_type type, uintmax_t timestamp,
+             time_in_force tif = time_in_force::good_till_cancel) {
+    this->id = id;
+    this->price = price;
+    this->count = count;
+    this->execution_id = 1;
+    this->type = type;
+    this->tif = tif;
+    this->timestamp = timestamp;
+    this->instrument = instrument;
+    prev = next = nullptr;
+    level = nullptr;
+    resting = false;
+  }
 
-  bool available() { return (!cancelled) && count > 0; }
+  std::string_view symbol() const { return symbol_view(instrument); }
+
+  bool available() const { return count > 0; }
 
   friend std::ostream &operator<<(std::ostream &os, const order &order) {
-    os << order.id << " " << order.instrument << " " << order.price << " "
+    os << order.id << " " << order.symbol() << " " << order.price << " "
        << order.count << " " << order.type << " " << order.timestamp << " "
-       << order.execution_id << " " << order.cancelled;
+       << order.execution_id << " " << order.resting;
     return os;
   }
 
   bool operator==(const order &other) const { return id == other.id; }
 };
 
-// Comparator for low price (min-heap)
-struct MinPriceComparator {
-  bool operator()(std::shared_ptr<order> a, std::shared_ptr<order> b) const {
-    if (a->price == b->price) {
-      if (a->timestamp == b->timestamp) {
-        return a->id < b->id;
+using order_pool = slab_pool<order>;
+
+// FIFO of resting orders at a single price, linked through the orders
+struct price_level {
+  order *head = nullptr;
+  order *tail = nullptr;
+  // remaining count over all the orders, and how many there are
+  uint64_t quantity = 0;
+  uint32_t orders = 0;
+
+  bool empty() const { return head == nullptr; }
+
+  void push_back(order *order) {
+    quantity += order->count;
+    orders++;
+    order->prev = tail;
+    order->next = nullptr;
+    order->level = this;
+    if (tail) {
+      tail->next = order;
+    } else {
+      head = order;
+    }
+    tail = order;
+  }
+
+  void unlink(order *order) {
+    quantity -= order->count;
+    orders--;
+    (order->prev ? order->prev->next : head) = order->next;
+    (order->next ? order->next->prev : tail) = order->prev;
+    order->prev = order->next = nullptr;
+    order->level = nullptr;
+  }
+};
+
+// Aggregate of one price level, as published on the market data feed
+struct depth_level {
+  uint32_t price;
+  uint32_t orders;
+  uint64_t quantity;
+
+  bool operator==(const depth_level &) const = default;
+};
+
+// Storage for price_bitmap::SIZE levels, zeroed (empty) and only backed by
+// memory once touched, so an instrument pays for the levels it uses. Null if
+// it could not be mapped.
+price_level *allocate_level_window();
+void free_level_window(price_level *window);
+
+// Level storage policies. Each keeps one side's non-empty price levels,
+// best first by Compare, with the same interface: empty(), level_for()
+// to find or add the level at a price, remove() once a level has emptied,
+// best(), and visit() to walk the levels best first.
+
+// Levels within a window of price_bitmap::SIZE prices live in an array
+// indexed by price, with a bitmap of the occupied ones, so the next best
+// level after the top empties is a couple of bit scans away however
+// sparse the book is. Prices outside the window go to an ordered map. The
+// window is placed around the first price to arrive whenever the side is
+// empty, so it follows an instrument whose prices drift. Best for a narrow
+// price band. The window is mapped by map_window() when the instrument is
+// created, so matching never waits on mmap.
+template <typename Compare> class dense_levels {
+public:
+  dense_levels() = default;
+  ~dense_levels() { free_level_window(window); }
+  dense_levels(const dense_levels &) = delete;
+  dense_levels &operator=(const dense_levels &) = delete;
+
+  // Returns false if there was no memory for the window, in which case the
+  // side must not be used
+  bool map_window() {
+    window = allocate_level_window();
+    return window != nullptr;
+  }
+
+  bool empty() const { return occupied.empty() && overflow.empty(); }
+
+  // levels that did not fit in the window
+  size_t overflow_levels() const { return overflow.size(); }
+
+  price_level &level_for(uint32_t price) {
+    if (empty()) {
+      // centred on the price, nothing needs moving while the side is empty
+      constexpr uint32_t HALF = price_bitmap::SIZE / 2;
+      constexpr uint32_t LAST_BASE = UINT32_MAX - price_bitmap::SIZE + 1;
+      base = price < HALF ? 0 : std::min(price - HALF, LAST_BASE);
+    }
+    uint32_t index = price - base;
+    if (index >= price_bitmap::SIZE) {
+      return overflow[price];
+    }
+    occupied.set(index);
+    return window[index];
+  }
+
+  void remove(uint32_t price) {
+    uint32_t index = price - base;
+    if (index < price_bitmap::SIZE) {
+      occupied.clear(index);
+    } else {
+      overflow.erase(price);
+    }
+  }
+
+  price_level *best() const {
+    uint32_t index = window_best();
+    if (overflow.empty() ||
+        (index != price_bitmap::NONE &&
+         Compare{}(base + index, overflow.begin()->first))) {
+      return &window[index];
+    }
+    return const_cast<price_level *>(&overflow.begin()->second);
+  }
+
+  // Calls f(price, level) on every level best first until it returns false
+  template <typename F> void visit(F &&f) const {
+    auto it = overflow.begin();
+    for (uint32_t index = window_best(); index != price_bitmap::NONE;
+         index = window_next(index)) {
+      uint32_t price = base + index;
+      // overflow levels better than this one
+      for (; it != overflow.end() && Compare{}(it->first, price); ++it) {
+        if (!f(it->first, it->second)) {
+          return;
+        }
+      }
+      if (!f(price, window[index])) {
+        return;
+      }
+    }
+    for (; it != overflow.end(); ++it) {
+      if (!f(it->first, it->second)) {
+        return;
+      }
+    }
+  }
+
+private:
+  // whether the best price is the highest, as for bids
+  static constexpr bool DESCENDING = Compare{}(1u, 0u);
+
+  // prices [base, base + SIZE) live in window, flagged in occupied
+  uint32_t base = 0;
+  price_level *window = nullptr;
+  price_bitmap occupied;
+  // levels outside the window, best first
+  std::map<uint32_t, price_level, Compare> overflow;
+
+  // window position of the best level there, or NONE
+  uint32_t window_best() const {
+    return DESCENDING ? occupied.highest() : occupied.lowest();
+  }
+
+  uint32_t window_next(uint32_t index) const {
+    return DESCENDING ? occupied.next_below(index) : occupied.next_above(index);
+  }
+};
+
+// Every level in an ordered map. No fixed footprint and no window to fall
+// out of, at the cost of a tree insert and erase per level. Best for a
+// wide or scattered price range.
+template <typename Compare> class sparse_levels {
+public:
+  bool empty() const { return levels.empty(); }
+
+  // distance between the best and worst levels
+  uint32_t span() const {
+    if (levels.empty()) {
+      return 0;
+    }
+    uint32_t best = levels.begin()->first;
+    uint32_t worst = levels.rbegin()->first;
+    return best > worst ? best - worst : worst - best;
+  }
+
+  price_level &level_for(uint32_t price) { return levels[price]; }
+
+  void remove(uint32_t price) { levels.erase(price); }
+
+  price_level *best() const {
+    return const_cast<price_level *>(&levels.begin()->second);
+  }
+
+  // Calls f(price, level) on every level best first until it returns false
+  template <typename F> void visit(F &&f) const {
+    for (const auto &[price, level] : levels) {
+      if (!f(price, level)) {
+        return;
       }
-      return a->timestamp < b->timestamp;
     }
-    return a->price < b->price;
   }
+
+private:
+  std::map<uint32_t, price_level, Compare> levels;
 };
 
-// Comparator for high price (max-heap)
-struct MaxPriceComparator {
-  bool operator()(std::shared_ptr<order> a, std::shared_ptr<order> b) const {
-    if (a->price == b->price) {
-      if (a->timestamp == b->timestamp) {
-        return a->id < b->id;
+// One side of an instrument's book: price levels ordered best-first by
+// Compare, each holding its orders in arrival (time priority) order, kept
+// in Storage. The side is a compile-time parameter, so matching compares
+// prices without branching on which side an order is on.
+template <typename Compare, template <typename> class Storage>
+class book_side {
+public:
+  // whether an incoming order limited to price reaches a level of this
+  // side at level_price
+  static bool crossed_by(uint32_t price, uint32_t level_price) {
+    return !Compare{}(price, level_price);
+  }
+
+  bool empty() const { return levels.empty(); }
+
+  // oldest order at the best price, side must not be empty
+  order *best() const { return levels.best()->head; }
+
+  // resting orders; only the instrument's owner writes it, anyone may read
+  uint32_t size() const { return count.load(std::memory_order_relaxed); }
+
+  const Storage<Compare> &storage() const { return levels; }
+  Storage<Compare> &storage() { return levels; }
+
+  void push(order *order) {
+    levels.level_for(order->price).push_back(order);
+    order->resting = true;
+    adjust_count(1);
+  }
+
+  // takes count off the best order, which must have at least that much
+  void fill_best(uint32_t count) {
+    price_level *level = levels.best();
+    level->head->count -= count;
+    level->quantity -= count;
+  }
+
+  // lowers a resting order's count in place, keeping its time priority
+  void reduce(order *order, uint32_t count) {
+    order->level->quantity -= order->count - count;
+    order->count = count;
+  }
+
+  void pop_best() { erase(levels.best()->head); }
+
+  // visits resting orders best price first, in time priority within a price
+  template <typename F> void for_each(F &&f) const {
+    levels.visit([&](uint32_t, const price_level &level) {
+      for (const order *order = level.head; order; order = order->next) {
+        f(*order);
+      }
+      return true;
+    });
+  }
+
+  // Whether the levels at price or better hold at least count in total.
+  // Looks at no more levels than it needs to.
+  bool can_fill(uint32_t price, uint32_t count) const {
+    uint64_t available = 0;
+    levels.visit([&](uint32_t level_price, const price_level &level) {
+      if (!crossed_by(price, level_price)) {
+        return false;
+      }
+      available += level.quantity;
+      return available < count;
+    });
+    return available >= count;
+  }
+
+  // aggregates of the best out.size() levels, best first; returns how many
+  // levels there are
+  size_t depth(std::span<depth_level> out) const {
+    size_t n = 0;
+    levels.visit([&](uint32_t price, const price_level &level) {
+      if (n == out.size()) {
+        return false;
       }
-      return a->timestamp < b->timestamp;
+      out[n++] = {price, level.orders, level.quantity};
+      return true;
+    });
+    return n;
+  }
+
+  void erase(order *order) {
+    price_level *level = order->level;
+    level->unlink(order);
+    order->resting = false;
+    adjust_count(-1);
+    if (level->empty()) {
+      levels.remove(order->price);
     }
-    return a->price > b->price;
+  }
+
+private:
+  Storage<Compare> levels;
+  std::atomic<uint32_t> count{0};
+
+  void adjust_count(int32_t delta) {
+    count.store(count.load(std::memory_order_relaxed) + delta,
+                std::memory_order_relaxed);
   }
 };
 
-// Define specific types for each comparator
-using min_pq = std::set<std::shared_ptr<order>, MinPriceComparator>;
-using max_pq = std::set<std::shared_ptr<order>, MaxPriceComparator>;
+// Both sides of an instrument's book, stored one way
+template <template <typename> class Storage> struct book_sides {
+  // highest bid first
+  book_side<std::greater<uint32_t>, Storage> buys;
+  // lowest ask first
+  book_side<std::less<uint32_t>, Storage> sells;
+
+  uint32_t size() const { return buys.size() + sells.size(); }
+};
+
+using dense_book = book_sides<dense_levels>;
+using sparse_book = book_sides<sparse_levels>;
+
+// How an instrument's levels are stored
+enum class book_layout : uint8_t { dense, sparse };
+
+// Which layout new instruments get, and whether it may change
+enum class layout_policy : uint8_t {
+  dense,
+  sparse,
+  // start sparse, go dense once a book fills up within a narrow band, and
+  // back to sparse when its prices spread past the dense window
+  adaptive,
+};
 
 class instrument {
 public:
-  std::shared_ptr<max_pq> buy_pq;
-  std::shared_ptr<min_pq> sell_pq;
+  const uint64_t symbol;
+  // which of the books below holds the orders; the other one is empty.
+  // Only the instrument's owner reads or changes it.
+  book_layout layout;
+  dense_book dense;
+  sparse_book sparse;
+  // whether the dense book got its windows; it is never used without them
+  const bool has_windows;
   std::mutex mtx;
+  // published depth, created by the owner on the first change when the
+  // market data feed is on
+  market_depth *depth = nullptr;
+
+  // Maps the dense windows unless policy keeps the book sparse, falling
+  // back to sparse if they cannot be had
+  instrument(uint64_t symbol, layout_policy policy);
+
+  // Calls f with the book in use. The caller must own the instrument.
+  template <typename F> decltype(auto) with_book(F &&f) {
+    return layout == book_layout::dense ? f(dense) : f(sparse);
+  }
+  template <typename F> decltype(auto) with_book(F &&f) const {
+    return layout == book_layout::dense ? f(dense) : f(sparse);
+  }
+
+  // resting orders a side, safe to read from any thread
+  uint32_t buy_count() const { return dense.buys.size() + sparse.buys.size(); }
+  uint32_t sell_count() const {
+    return dense.sells.size() + sparse.sells.size();
+  }
+};
+
+// A client's handle on one of its orders. The pooled order may be released
+// and reused once it is filled or cancelled; that is detected by comparing
+// generations under the instrument lock.
+struct order_ref {
+  order *ptr;
+  uint32_t generation;
+  instrument *instr;
+
+  bool live() const {
+    return ptr->generation.load(std::memory_order_relaxed) == generation;
+  }
+};
+
+// One of a client's orders, as remembered for mass cancel
+struct owned_order {
+  uint32_t id;
+  order_ref ref;
+};
+
+enum class book_action : uint8_t { match, cancel, amend };
 
-  instrument()
-      : buy_pq(std::make_shared<max_pq>()),
-        sell_pq(std::make_shared<min_pq>()) {}
+// A new order to match, a cancel or an amend, as queued from a framed batch
+struct book_op {
+  book_action action;
+  uint32_t order_id;
+  order_ref ref;
+  // for amend, the new price and count
+  uint32_t price = 0;
+  uint32_t count = 0;
+  // where the command sits in its batch, for journaling it
+  uint32_t position = 0;
 };
 
+// Takes the instrument lock, timing the wait and counting contention if
+// stats are on
+std::unique_lock<std::mutex> lock_instrument(instrument &instrument);
+
 class order_book {
 private:
-  // max_pq for buy orders, min_pq for sell orders
-  HashMap<std::string, std::shared_ptr<instrument>> book;
+  // instruments are never removed, so pointers handed out stay valid
+  HashMap<uint64_t, instrument *, symbol_hash> book;
+  std::deque<instrument> instruments;
+  std::mutex instruments_mtx;
+  layout_policy policy = layout_policy::adaptive;
+
+  // Switches instrument to the other layout if its prices call for it
+  void adapt_layout(instrument &instrument);
 
 public:
-  void add_order(std::shared_ptr<order> order);
-  void add_instrument(const std::string &instrument);
-  bool instrument_exists(const std::string &instrument);
-  void find_match(std::shared_ptr<order> active_order);
-  void cancel_order(std::shared_ptr<order> order);
+  // Sets the layout of instruments created from now on; call before any
+  // are created.
+  void set_layout_policy(layout_policy policy) { this->policy = policy; }
+  // instrument for a packed symbol, created on first use
+  instrument *resolve(uint64_t symbol);
+  void find_match(instrument &instrument, order *active_order);
+  void cancel_order(uint32_t order_id, const order_ref &ref);
+  // Gives a resting order a new price and count. Lowering only the count
+  // keeps its place in the queue; anything else moves it to the back of
+  // its (new) level, matching first if it now crosses. A count of 0
+  // cancels it.
+  void amend_order(uint32_t order_id, const order_ref &ref, uint32_t price,
+                   uint32_t count);
+  // Cancels whichever of orders (all on instrument) are still resting,
+  // under a single lock. Orders that already left the book are skipped
+  // silently.
+  void cancel_all(instrument &instrument, std::span<const owned_order> orders);
+  // Matches, cancels or amends each of ops (all on instrument) in order,
+  // under a single lock.
+  void run_batch(instrument &instrument, std::span<const book_op> ops);
+
+  // The same without taking instrument.mtx. The caller must hold it or be
+  // the only thread that ever touches the instrument (its shard).
+  void find_match_unlocked(instrument &instrument, order *active_order);
+  void cancel_order_unlocked(uint32_t order_id, const order_ref &ref);
+  void amend_order_unlocked(uint32_t order_id, const order_ref &ref,
+                            uint32_t price, uint32_t count);
+  void cancel_all_unlocked(instrument &instrument,
+                           std::span<const owned_order> orders);
+  void run_batch_unlocked(instrument &instrument,
+                          std::span<const book_op> ops);
   void print_instr_top(const std::string &instrument_str);
   void print_all_top();
+  // resting order counts, busiest instruments first
+  void print_resting(std::ostream &os, size_t limit);
+
+  // every instrument created so far
+  std::vector<instrument *> all_instruments();
+  // Appends instrument's resting orders to out in snapshot order. The
+  // caller must own the instrument, as for the _unlocked calls above.
+  void snapshot_unlocked(instrument &instrument,
+                         std::vector<snapshot_order> &out);
+  // Rests the orders of a snapshot, in file order, without emitting events,
+  // and appends a handle on each to restored.
+  void restore(std::span<const snapshot_order> orders,
+               std::vector<owned_order> &restored);
 };
+
+// Return a filled or cancelled order to the pool
+inline void release_order(order *order) {
+  order->generation.fetch_add(1, std::memory_order_relaxed);
+  order_pool::instance().release(order);
+}
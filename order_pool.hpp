@@ -0,0 +1,82 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Fixed-size object pool carved out of large slabs. Objects are default
+// constructed once when their slab is allocated and are recycled without
+// being destroyed, so callers reinitialise them after acquire(). Slabs are
+// never handed back to the allocator: a pointer into the pool stays
+// dereferenceable after release, and owners detect reuse through state kept
+// in the object itself (e.g. a generation count).
+//
+// Each thread keeps a private free list and only touches the shared one,
+// under a mutex, to move whole batches in or out.
+template <typename T, size_t SlabSize = 4096, size_t Batch = 256>
+class slab_pool {
+public:
+  // process-wide pool for T, intentionally leaked so detached threads can
+  // still release into it during exit
+  static slab_pool &instance() {
+    static slab_pool *pool = new slab_pool();
+    return *pool;
+  }
+
+  T *acquire() {
+    std::vector<T *> &cache = local().free;
+    if (cache.empty()) {
+      refill(cache);
+    }
+    T *object = cache.back();
+    cache.pop_back();
+    return object;
+  }
+
+  void release(T *object) {
+    std::vector<T *> &cache = local().free;
+    cache.push_back(object);
+    if (cache.size() >= 2 * Batch) {
+      std::scoped_lock<std::mutex> lock(mtx);
+      free_list.insert(free_list.end(), cache.end() - Batch, cache.end());
+      cache.resize(cache.size() - Batch);
+    }
+  }
+
+private:
+  struct local_cache {
+    slab_pool *owner;
+    std::vector<T *> free;
+
+    ~local_cache() {
+      std::scoped_lock<std::mutex> lock(owner->mtx);
+      owner->free_list.insert(owner->free_list.end(), free.begin(), free.end());
+    }
+  };
+
+  std::mutex mtx;
+  std::vector<std::unique_ptr<T[]>> slabs;
+  std::vector<T *> free_list;
+
+  slab_pool() = default;
+
+  local_cache &local() {
+    thread_local local_cache cache{this, {}};
+    return cache;
+  }
+
+  void refill(std::vector<T *> &cache) {
+    std::scoped_lock<std::mutex> lock(mtx);
+    if (!free_list.empty()) {
+      size_t n = std::min(Batch, free_list.size());
+      cache.insert(cache.end(), free_list.end() - n, free_list.end());
+      free_list.resize(free_list.size() - n);
+      return;
+    }
+    T *slab = slabs.emplace_back(std::make_unique<T[]>(SlabSize)).get();
+    for (size_t i = SlabSize; i > 0; i--) {
+      cache.push_back(&slab[i - 1]);
+    }
+  }
+};
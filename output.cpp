@@ -0,0 +1,388 @@
+#include "output.hpp"
+#include "symbol.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+// sequence number handed to the next emitted event
+std::atomic<uint64_t> next_seq{0};
+// set by the writer just before it blocks waiting for next_seq to move
+std::atomic<uint32_t> writer_sleeping{0};
+
+std::mutex rings_mtx;
+std::vector<event_ring *> rings;
+// bumped whenever a ring is registered so the writer knows to rescan
+std::atomic<uint32_t> rings_version{0};
+// rings whose threads have exited, waiting to be freed by the writer
+std::atomic<uint32_t> rings_detached{0};
+
+std::thread writer_thread;
+int output_fd = -1;
+output_format writer_format = output_format::text;
+// set before any thread emits, see output_format::discard
+bool discarding = false;
+
+struct ring_handle {
+  event_ring *ring = nullptr;
+
+  ~ring_handle() {
+    if (ring) {
+      ring->detached.store(true, std::memory_order_release);
+      rings_detached.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+};
+
+event_ring &local_ring() {
+  thread_local ring_handle handle;
+  if (!handle.ring) {
+    handle.ring = new event_ring();
+    std::scoped_lock<std::mutex> lock(rings_mtx);
+    rings.push_back(handle.ring);
+    rings_version.fetch_add(1, std::memory_order_release);
+  }
+  return *handle.ring;
+}
+
+char *append_uint(char *p, uintmax_t v) {
+  return std::to_chars(p, p + 20, v).ptr;
+}
+
+void write_all(const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(output_fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write");
+      return;
+    }
+    buf += n;
+    len -= static_cast<size_t>(n);
+  }
+}
+
+void writer_loop() {
+  constexpr size_t BUFFER_SIZE = 1 << 16;
+  constexpr size_t MAX_RECORD = std::max(MAX_EVENT_TEXT, MAX_BINARY_RECORD);
+  std::vector<char> buffer(BUFFER_SIZE);
+  size_t used = 0;
+  auto write_event = writer_format == output_format::binary ? encode_event
+                                                            : format_event;
+  if (writer_format == output_format::binary) {
+    memcpy(buffer.data(), BINARY_MAGIC, sizeof(BINARY_MAGIC));
+    used = sizeof(BINARY_MAGIC);
+  }
+  uint64_t expected = 0;
+  uint32_t seen_version = ~0u;
+  std::vector<event_ring *> local;
+
+  auto refresh = [&] {
+    uint32_t version = rings_version.load(std::memory_order_acquire);
+    if (version == seen_version) {
+      return;
+    }
+    std::scoped_lock<std::mutex> lock(rings_mtx);
+    seen_version = rings_version.load(std::memory_order_relaxed);
+    local = rings;
+  };
+
+  // frees rings whose threads have exited and that hold nothing more
+  auto reap = [&] {
+    if (rings_detached.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    std::scoped_lock<std::mutex> lock(rings_mtx);
+    std::erase_if(rings, [](event_ring *ring) {
+      bool drained = ring->detached.load(std::memory_order_acquire) &&
+                     ring->head.load(std::memory_order_relaxed) ==
+                         ring->tail.load(std::memory_order_acquire);
+      if (drained) {
+        delete ring;
+        rings_detached.fetch_sub(1, std::memory_order_relaxed);
+      }
+      return drained;
+    });
+    local = rings;
+    seen_version = rings_version.fetch_add(1, std::memory_order_relaxed) + 1;
+  };
+
+  while (true) {
+    refresh();
+    bool progress = false;
+    for (event_ring *ring : local) {
+      uint64_t head = ring->head.load(std::memory_order_relaxed);
+      uint64_t tail = ring->tail.load(std::memory_order_acquire);
+      // each ring is already in sequence order, take the run that is next
+      while (head != tail) {
+        const output_event &e = ring->events[head % event_ring::CAPACITY];
+        if (e.seq != expected) {
+          break;
+        }
+        if (e.kind == event_kind::shutdown) {
+          ring->head.store(head + 1, std::memory_order_release);
+          write_all(buffer.data(), used);
+          return;
+        }
+        if (BUFFER_SIZE - used < MAX_RECORD) {
+          write_all(buffer.data(), used);
+          used = 0;
+        }
+        used += write_event(buffer.data() + used, e);
+        head++;
+        expected++;
+        progress = true;
+      }
+      ring->head.store(head, std::memory_order_release);
+    }
+    if (progress) {
+      continue;
+    }
+
+    if (next_seq.load(std::memory_order_acquire) != expected) {
+      // the next event is still being pushed, or its ring is new to us
+      std::this_thread::yield();
+      continue;
+    }
+
+    // caught up: put the batch out before going to sleep
+    write_all(buffer.data(), used);
+    used = 0;
+    reap();
+    writer_sleeping.store(1, std::memory_order_seq_cst);
+    if (next_seq.load(std::memory_order_seq_cst) == expected) {
+      writer_sleeping.wait(1, std::memory_order_seq_cst);
+    }
+    writer_sleeping.store(0, std::memory_order_relaxed);
+  }
+}
+
+} // namespace
+
+size_t format_event(char *buf, const output_event &e) {
+  char *p = buf;
+  switch (e.kind) {
+  case event_kind::added: {
+    *p++ = e.flag ? 'S' : 'B';
+    *p++ = ' ';
+    p = append_uint(p, e.id);
+    *p++ = ' ';
+    std::string_view symbol = symbol_view(e.symbol);
+    memcpy(p, symbol.data(), symbol.size());
+    p += symbol.size();
+    *p++ = ' ';
+    p = append_uint(p, e.price);
+    *p++ = ' ';
+    p = append_uint(p, e.count);
+    break;
+  }
+  case event_kind::executed:
+    *p++ = 'E';
+    *p++ = ' ';
+    p = append_uint(p, e.id);
+    *p++ = ' ';
+    p = append_uint(p, e.other_id);
+    *p++ = ' ';
+    p = append_uint(p, e.execution_id);
+    *p++ = ' ';
+    p = append_uint(p, e.price);
+    *p++ = ' ';
+    p = append_uint(p, e.count);
+    break;
+  case event_kind::deleted:
+    *p++ = 'X';
+    *p++ = ' ';
+    p = append_uint(p, e.id);
+    *p++ = ' ';
+    *p++ = e.flag ? 'A' : 'R';
+    break;
+  case event_kind::amended:
+    *p++ = 'A';
+    *p++ = ' ';
+    p = append_uint(p, e.id);
+    *p++ = ' ';
+    p = append_uint(p, e.price);
+    *p++ = ' ';
+    p = append_uint(p, e.count);
+    break;
+  case event_kind::shutdown:
+    return 0;
+  }
+  *p++ = ' ';
+  p = std::to_chars(p, p + 21, e.timestamp).ptr;
+  *p++ = '\n';
+  return static_cast<size_t>(p - buf);
+}
+
+size_t binary_record_size(uint8_t kind) {
+  switch (static_cast<event_kind>(kind)) {
+  case event_kind::added:
+    return sizeof(binary_added);
+  case event_kind::executed:
+    return sizeof(binary_executed);
+  case event_kind::deleted:
+    return sizeof(binary_deleted);
+  case event_kind::amended:
+    return sizeof(binary_amended);
+  case event_kind::shutdown:
+    break;
+  }
+  return 0;
+}
+
+size_t encode_event(char *buf, const output_event &e) {
+  switch (e.kind) {
+  case event_kind::added: {
+    binary_added r{};
+    r.kind = static_cast<uint8_t>(e.kind);
+    r.is_sell = e.flag;
+    r.id = e.id;
+    r.price = e.price;
+    r.count = e.count;
+    r.timestamp = e.timestamp;
+    r.symbol = e.symbol;
+    memcpy(buf, &r, sizeof(r));
+    return sizeof(r);
+  }
+  case event_kind::executed: {
+    binary_executed r{};
+    r.kind = static_cast<uint8_t>(e.kind);
+    r.resting_id = e.id;
+    r.new_id = e.other_id;
+    r.execution_id = e.execution_id;
+    r.price = e.price;
+    r.count = e.count;
+    r.timestamp = e.timestamp;
+    memcpy(buf, &r, sizeof(r));
+    return sizeof(r);
+  }
+  case event_kind::deleted: {
+    binary_deleted r{};
+    r.kind = static_cast<uint8_t>(e.kind);
+    r.accepted = e.flag;
+    r.id = e.id;
+    r.timestamp = e.timestamp;
+    memcpy(buf, &r, sizeof(r));
+    return sizeof(r);
+  }
+  case event_kind::amended: {
+    binary_amended r{};
+    r.kind = static_cast<uint8_t>(e.kind);
+    r.id = e.id;
+    r.price = e.price;
+    r.count = e.count;
+    r.timestamp = e.timestamp;
+    memcpy(buf, &r, sizeof(r));
+    return sizeof(r);
+  }
+  case event_kind::shutdown:
+    break;
+  }
+  return 0;
+}
+
+output_event decode_event(const char *buf) {
+  output_event e{};
+  e.kind = static_cast<event_kind>(buf[0]);
+  switch (e.kind) {
+  case event_kind::added: {
+    binary_added r;
+    memcpy(&r, buf, sizeof(r));
+    e.flag = r.is_sell;
+    e.id = r.id;
+    e.price = r.price;
+    e.count = r.count;
+    e.timestamp = r.timestamp;
+    e.symbol = r.symbol;
+    break;
+  }
+  case event_kind::executed: {
+    binary_executed r;
+    memcpy(&r, buf, sizeof(r));
+    e.id = r.resting_id;
+    e.other_id = r.new_id;
+    e.execution_id = r.execution_id;
+    e.price = r.price;
+    e.count = r.count;
+    e.timestamp = r.timestamp;
+    break;
+  }
+  case event_kind::deleted: {
+    binary_deleted r;
+    memcpy(&r, buf, sizeof(r));
+    e.flag = r.accepted;
+    e.id = r.id;
+    e.timestamp = r.timestamp;
+    break;
+  }
+  case event_kind::amended: {
+    binary_amended r;
+    memcpy(&r, buf, sizeof(r));
+    e.id = r.id;
+    e.price = r.price;
+    e.count = r.count;
+    e.timestamp = r.timestamp;
+    break;
+  }
+  case event_kind::shutdown:
+    break;
+  }
+  return e;
+}
+
+void event_writer::start(int fd, output_format format) {
+  output_fd = fd;
+  writer_format = format;
+  active = true;
+  if (format == output_format::discard) {
+    discarding = true;
+    return;
+  }
+  writer_thread = std::thread(writer_loop);
+}
+
+void event_writer::stop() {
+  if (!active) {
+    return;
+  }
+  if (discarding) {
+    active = false;
+    return;
+  }
+  output_event e{};
+  e.kind = event_kind::shutdown;
+  emit(e);
+  writer_thread.join();
+  active = false;
+}
+
+void event_writer::emit(output_event e) {
+  if (discarding) {
+    return;
+  }
+  event_ring &ring = local_ring();
+  uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+  while (tail - ring.head.load(std::memory_order_acquire) ==
+         event_ring::CAPACITY) {
+    // the writer is behind, wait for room rather than drop output
+    std::this_thread::yield();
+  }
+  e.seq = next_seq.fetch_add(1, std::memory_order_seq_cst);
+  ring.events[tail % event_ring::CAPACITY] = e;
+  ring.tail.store(tail + 1, std::memory_order_release);
+  if (writer_sleeping.load(std::memory_order_seq_cst)) {
+    writer_sleeping.store(0, std::memory_order_relaxed);
+    writer_sleeping.notify_one();
+  }
+}
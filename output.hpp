@@ -0,0 +1,124 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Asynchronous event output.
+//
+// Matching threads stamp each event with a global sequence number, taken
+// while they still hold the instrument lock, and push it into a ring of
+// their own. A single writer thread merges the rings back into sequence
+// order, formats the text and writes it out in large batches, so the
+// printed stream is the same one the synchronous path would produce.
+
+enum class event_kind : uint8_t { added, executed, deleted, amended, shutdown };
+
+struct output_event {
+  uint64_t seq;
+  intmax_t timestamp;
+  event_kind kind;
+  // sell side for added, cancel accepted for deleted
+  bool flag;
+  uint32_t id;
+  // new (active) order id for executed
+  uint32_t other_id;
+  uint32_t execution_id;
+  // for amended, the order's new price and count
+  uint32_t price;
+  uint32_t count;
+  // packed symbol for added
+  uint64_t symbol;
+};
+
+// Longest formatted event: "E " and five 10-digit ids, a 20-digit timestamp
+constexpr size_t MAX_EVENT_TEXT = 96;
+
+// Formats e as one line of engine output, returning the bytes written.
+size_t format_event(char *buf, const output_event &e);
+
+// Binary output: an 8-byte header, then one fixed-width little-endian record
+// per event. The first byte of every record is its event_kind and decides
+// its size. Fields are laid out so no packing is needed.
+constexpr char BINARY_MAGIC[8] = {'M', 'E', 'B', 'I', 'N', '1', 0, 0};
+
+struct binary_added {
+  uint8_t kind;
+  uint8_t is_sell;
+  uint16_t reserved;
+  uint32_t id;
+  uint32_t price;
+  uint32_t count;
+  int64_t timestamp;
+  uint64_t symbol;
+};
+
+struct binary_executed {
+  uint8_t kind;
+  uint8_t reserved[3];
+  uint32_t resting_id;
+  uint32_t new_id;
+  uint32_t execution_id;
+  uint32_t price;
+  uint32_t count;
+  int64_t timestamp;
+};
+
+struct binary_deleted {
+  uint8_t kind;
+  uint8_t accepted;
+  uint16_t reserved;
+  uint32_t id;
+  int64_t timestamp;
+};
+
+struct binary_amended {
+  uint8_t kind;
+  uint8_t reserved[3];
+  uint32_t id;
+  uint32_t price;
+  uint32_t count;
+  int64_t timestamp;
+};
+
+static_assert(sizeof(binary_added) == 32);
+static_assert(sizeof(binary_executed) == 32);
+static_assert(sizeof(binary_deleted) == 16);
+static_assert(sizeof(binary_amended) == 24);
+
+constexpr size_t MAX_BINARY_RECORD = 32;
+
+// Size of a record starting with kind, or 0 if kind is not a record type
+size_t binary_record_size(uint8_t kind);
+// Encodes e as a binary record, returning the bytes written.
+size_t encode_event(char *buf, const output_event &e);
+// Decodes one record of binary_record_size(buf[0]) bytes.
+output_event decode_event(const char *buf);
+
+// discard drops every event without starting the writer, for benchmarks
+enum class output_format { text, binary, discard };
+
+// Single-producer single-consumer ring owned by one matching thread
+struct event_ring {
+  static constexpr size_t CAPACITY = 1024;
+
+  alignas(64) std::atomic<uint64_t> head{0}; // next slot the writer reads
+  alignas(64) std::atomic<uint64_t> tail{0}; // next slot the owner fills
+  // set when the owning thread exits, the writer frees it once drained
+  std::atomic<bool> detached{false};
+  output_event events[CAPACITY];
+};
+
+class event_writer {
+public:
+  // Starts the writer thread on fd. Must be called before any thread emits.
+  static void start(int fd, output_format format = output_format::text);
+  // Flushes everything emitted so far and joins the writer.
+  static void stop();
+  static bool running() { return active.load(std::memory_order_relaxed); }
+  // Stamps e with the next sequence number and queues it.
+  static void emit(output_event e);
+
+private:
+  static inline std::atomic<bool> active = false;
+};
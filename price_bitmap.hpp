@@ -0,0 +1,88 @@
+#pragma once
+
+#include <bit>
+#include <cstdint>
+
+// Occupancy of SIZE consecutive prices.
+//
+// One bit per price in 64 words, and a summary word above them with bit w
+// set while word w has any bit set. The lowest or highest occupied price,
+// or the next one either side of a given price, is found with one count of
+// zeros on the summary and one on the word it points to (tzcnt and lzcnt
+// where the target has them), however far apart the occupied prices are.
+class price_bitmap {
+public:
+  static constexpr uint32_t WORDS = 64;
+  static constexpr uint32_t SIZE = WORDS * 64;
+  // returned when there is no such position
+  static constexpr uint32_t NONE = UINT32_MAX;
+
+  bool empty() const { return summary == 0; }
+
+  bool test(uint32_t i) const { return words[i >> 6] >> (i & 63) & 1; }
+
+  void set(uint32_t i) {
+    words[i >> 6] |= uint64_t{1} << (i & 63);
+    summary |= uint64_t{1} << (i >> 6);
+  }
+
+  void clear(uint32_t i) {
+    uint64_t &word = words[i >> 6];
+    word &= ~(uint64_t{1} << (i & 63));
+    if (word == 0) {
+      summary &= ~(uint64_t{1} << (i >> 6));
+    }
+  }
+
+  uint32_t lowest() const {
+    if (summary == 0) {
+      return NONE;
+    }
+    uint32_t w = std::countr_zero(summary);
+    return w * 64 + std::countr_zero(words[w]);
+  }
+
+  uint32_t highest() const {
+    if (summary == 0) {
+      return NONE;
+    }
+    uint32_t w = 63 - std::countl_zero(summary);
+    return w * 64 + 63 - std::countl_zero(words[w]);
+  }
+
+  // lowest set position above i
+  uint32_t next_above(uint32_t i) const {
+    uint32_t w = i >> 6;
+    uint32_t bit = i & 63;
+    uint64_t rest = bit == 63 ? 0 : words[w] & (~uint64_t{0} << (bit + 1));
+    if (rest != 0) {
+      return w * 64 + std::countr_zero(rest);
+    }
+    uint64_t later = w == 63 ? 0 : summary & (~uint64_t{0} << (w + 1));
+    if (later == 0) {
+      return NONE;
+    }
+    w = std::countr_zero(later);
+    return w * 64 + std::countr_zero(words[w]);
+  }
+
+  // highest set position below i
+  uint32_t next_below(uint32_t i) const {
+    uint32_t w = i >> 6;
+    uint32_t bit = i & 63;
+    uint64_t rest = words[w] & ((uint64_t{1} << bit) - 1);
+    if (rest != 0) {
+      return w * 64 + 63 - std::countl_zero(rest);
+    }
+    uint64_t earlier = summary & ((uint64_t{1} << w) - 1);
+    if (earlier == 0) {
+      return NONE;
+    }
+    w = 63 - std::countl_zero(earlier);
+    return w * 64 + 63 - std::countl_zero(words[w]);
+  }
+
+private:
+  uint64_t summary = 0;
+  uint64_t words[WORDS] = {};
+};
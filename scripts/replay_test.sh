@@ -0,0 +1,56 @@
+#!/bin/bash
+# Journals a run of two clients racing on one instrument, replays the
+# journal and checks the replay prints the same events in the same order as
+# the live run (timestamps aside). Extra arguments go to both engines, e.g.
+#
+#   scripts/replay_test.sh --shards 2
+#
+# Run from the repository root after make.
+
+set -eu
+
+orders=${ORDERS:-200000}
+dir=$(mktemp -d)
+engine=
+trap 'if [ -n "$engine" ]; then kill $engine 2>/dev/null; fi; rm -rf "$dir"' EXIT
+
+# orders on one symbol around a single price, with cancels and amends of
+# earlier ones; the client sends id n from connection n % 2
+awk -v n="$orders" 'BEGIN {
+	srand(3211)
+	for (id = 1; id <= n; id++) {
+		r = rand()
+		if (id > 10 && r < 0.15) {
+			printf "C %d\n", id - 2 * int(rand() * 5)
+		} else if (id > 10 && r < 0.25) {
+			printf "A %d %d %d\n", id - 2 * int(rand() * 5), 95 + int(rand() * 11), 1 + int(rand() * 20)
+		} else {
+			printf "%s %d GOOG %d %d\n", rand() < 0.5 ? "B" : "S", id, 95 + int(rand() * 11), 1 + int(rand() * 20)
+		}
+	}
+}' > "$dir/input"
+
+./engine --journal "$dir/journal" --journal-size 64 "$@" "$dir/sock" > "$dir/live.out" &
+engine=$!
+while [ ! -S "$dir/sock" ]; do sleep 0.01; done
+./client --load --connections 2 --write-size 4 "$dir/sock" < "$dir/input" 2> /dev/null
+# the engine never exits on its own; give the writer time to catch up
+sleep 1
+kill $engine
+wait $engine || true
+engine=
+
+./engine --replay "$dir/journal" "$@" > "$dir/replay.out"
+
+strip() { awk '{ NF--; print }' "$1"; }
+lines=$(wc -l < "$dir/live.out")
+if [ "$lines" -eq 0 ]; then
+	echo "replay_test: the live run printed nothing" >&2
+	exit 1
+fi
+if ! cmp -s <(strip "$dir/live.out") <(strip "$dir/replay.out"); then
+	echo "replay_test: replay differs from the live run:" >&2
+	diff <(strip "$dir/live.out") <(strip "$dir/replay.out") | head -20 >&2
+	exit 1
+fi
+echo "replay_test: $lines events replayed identically"
@@ -0,0 +1,93 @@
+#!/bin/bash
+# Snapshots a book at exit, restores it into a new engine and checks that
+# clients can cancel and amend the restored orders by id, that a client
+# that has taken one over cancels it with its mass cancel, and that orders
+# sharing an id are left out. Extra arguments go to both engines, e.g.
+#
+#   scripts/restore_test.sh --shards 2
+#
+# Run from the repository root after make.
+
+set -eu
+
+dir=$(mktemp -d)
+engine=
+trap 'if [ -n "$engine" ]; then kill $engine 2>/dev/null; fi; rm -rf "$dir"' EXIT
+
+# starts an engine on $dir/sock with the given options, output to $dir/out
+start() {
+	rm -f "$dir/sock"
+	./engine "$@" "$dir/sock" > "$dir/out" 2> /dev/null &
+	engine=$!
+	while [ ! -S "$dir/sock" ]; do sleep 0.01; done
+}
+
+stop() {
+	sleep 0.3
+	kill $engine
+	wait $engine || true
+	engine=
+}
+
+start --snapshot "$dir/snap" "$@"
+./client "$dir/sock" <<EOF
+B 1 GOOG 100 10
+S 2 GOOG 105 5
+B 3 AAPL 50 1
+EOF
+stop
+
+start --restore "$dir/snap" "$@"
+./client "$dir/sock" <<EOF
+C 1
+A 2 106 4
+EOF
+./client "$dir/sock" <<EOF
+C 1
+A 3 51 2
+M
+C 3
+EOF
+stop
+
+# timestamps aside, in the order the clients sent them
+expected="X 1 A
+A 2 106 4
+X 1 R
+A 3 51 2
+X 3 A
+X 3 R"
+actual=$(awk '{ NF--; print }' "$dir/out")
+if [ "$actual" != "$expected" ]; then
+	echo "restore_test: unexpected output after restore:" >&2
+	diff <(echo "$expected") <(echo "$actual") >&2
+	exit 1
+fi
+
+# two clients may use the same id; neither order can be claimed safely
+start --snapshot "$dir/snap" "$@"
+./client "$dir/sock" <<EOF
+B 7 GOOG 100 10
+EOF
+./client "$dir/sock" <<EOF
+S 7 GOOG 110 10
+B 8 GOOG 99 1
+EOF
+stop
+
+start --restore "$dir/snap" "$@"
+./client "$dir/sock" <<EOF
+C 7
+C 8
+EOF
+stop
+
+expected="X 7 R
+X 8 A"
+actual=$(awk '{ NF--; print }' "$dir/out")
+if [ "$actual" != "$expected" ]; then
+	echo "restore_test: orders sharing an id were restored:" >&2
+	diff <(echo "$expected") <(echo "$actual") >&2
+	exit 1
+fi
+echo "restore_test: restored orders cancelled and amended by id"
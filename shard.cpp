@@ -0,0 +1,127 @@
+#include "shard.hpp"
+#include "affinity.hpp"
+#include "engine.hpp"
+#include "io.hpp"
+
+#include <ostream>
+
+matching_shard::matching_shard(order_book &book, journal_writer *journal,
+                               std::vector<int> cpus)
+    : book(book), journal(journal),
+      thread(&matching_shard::run, this, std::move(cpus)) {
+  thread.detach();
+}
+
+void matching_shard::submit(const shard_command &command) {
+  while (!queue.try_push(command)) {
+    std::this_thread::yield();
+  }
+  submitted.fetch_add(1, std::memory_order_relaxed);
+  // pairs with the fence in run: either the shard sees the command before it
+  // sleeps, or we see it asleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (sleeping.load(std::memory_order_relaxed)) {
+    sleeping.store(0, std::memory_order_relaxed);
+    sleeping.notify_one();
+  }
+}
+
+void matching_shard::drain() {
+  while (executed.load(std::memory_order_acquire) !=
+         submitted.load(std::memory_order_relaxed)) {
+    std::this_thread::yield();
+  }
+}
+
+void matching_shard::call(const std::function<void()> &task) {
+  std::atomic<bool> done{false};
+  submit({shard_action::call, 0, {}, nullptr, &task, &done});
+  while (!done.load(std::memory_order_acquire)) {
+    std::this_thread::yield();
+  }
+}
+
+void matching_shard::run(std::vector<int> cpus) {
+  if (!cpus.empty() && !pin_current_thread(cpus)) {
+    SyncCerr{} << "Could not pin shard thread" << std::endl;
+  }
+
+  // spin this many empty polls before blocking
+  constexpr int SPIN_LIMIT = 4096;
+  shard_command command;
+  int idle = 0;
+  while (true) {
+    if (queue.try_pop(command)) {
+      execute(command);
+      idle = 0;
+      continue;
+    }
+    if (++idle < SPIN_LIMIT) {
+      continue;
+    }
+
+    sleeping.store(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (queue.try_pop(command)) {
+      sleeping.store(0, std::memory_order_relaxed);
+      execute(command);
+    } else {
+      sleeping.wait(1, std::memory_order_relaxed);
+    }
+    idle = 0;
+  }
+}
+
+void matching_shard::execute(const shard_command &command) {
+  if (journal) {
+    switch (command.action) {
+    case shard_action::match:
+    case shard_action::cancel:
+    case shard_action::amend:
+      journal->append(journal_entry::command, command.connection,
+                      getCurrentTimestamp(), command.input);
+      break;
+    case shard_action::cancel_all:
+      journal->append_cancel_all(command.connection, getCurrentTimestamp(),
+                                 command.ref.instr->symbol);
+      break;
+    case shard_action::reject:
+      // journaled by whichever shard reports it, below
+    case shard_action::call:
+      break;
+    }
+  }
+
+  switch (command.action) {
+  case shard_action::match:
+    book.find_match_unlocked(*command.ref.instr, command.ref.ptr);
+    break;
+  case shard_action::cancel:
+    book.cancel_order_unlocked(command.order_id, command.ref);
+    break;
+  case shard_action::amend:
+    book.amend_order_unlocked(command.order_id, command.ref,
+                              command.input.price, command.input.count);
+    break;
+  case shard_action::cancel_all:
+    book.cancel_all_unlocked(*command.ref.instr, *command.orders);
+    delete command.orders;
+    break;
+  case shard_action::reject:
+    if (command.reject->remaining.fetch_sub(1, std::memory_order_acq_rel) ==
+        1) {
+      if (journal) {
+        journal->append(journal_entry::reject, command.connection,
+                        getCurrentTimestamp(), command.input);
+      }
+      Output::OrderDeleted(command.order_id, false, getCurrentTimestamp());
+      delete command.reject;
+    }
+    break;
+  case shard_action::call:
+    (*command.task)();
+    command.done->store(true, std::memory_order_release);
+    break;
+  }
+  executed.fetch_add(1, std::memory_order_release);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "io.hpp"
+#include "journal.hpp"
+#include "mpsc_queue.hpp"
+#include "order_book.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <thread>
+#include <vector>
+
+// Sharded matching.
+//
+// Instruments are split across a fixed set of matching threads by the hash
+// of their symbol. Each thread is the only one that ever touches the books
+// of its instruments, so it matches without taking the instrument lock.
+// Connection threads only parse and route: every command for an instrument
+// goes through its shard's queue, which keeps each client's commands on one
+// instrument in the order they were sent. The shard journals each command
+// as it runs it.
+
+enum class shard_action : uint8_t {
+  match,
+  cancel,
+  amend,
+  cancel_all,
+  reject,
+  call
+};
+
+// A cancel or amend of an id the client has no order for. It is handed to
+// every shard the client has used, and the last one to reach it reports it,
+// so it comes out after everything the client sent before it.
+struct shard_reject {
+  explicit shard_reject(uint32_t shards) : remaining(shards) {}
+  std::atomic<uint32_t> remaining;
+};
+
+struct shard_command {
+  shard_action action;
+  uint32_t order_id;
+  // for match, ref.ptr is the new order; for cancel_all only ref.instr is set
+  order_ref ref;
+  // for cancel_all, handed over to the shard which frees it
+  std::vector<owned_order> *orders = nullptr;
+  // for call, run on the shard thread and then set done
+  const std::function<void()> *task = nullptr;
+  std::atomic<bool> *done = nullptr;
+  // for match, cancel and amend, the command as the client sent it, and for
+  // those and cancel_all the client's connection, for the journal
+  ClientCommand input{};
+  uint32_t connection = 0;
+  // for reject, shared by the shards it went to; the last one frees it
+  shard_reject *reject = nullptr;
+};
+
+class matching_shard {
+public:
+  // runs the thread on cpus, empty leaving it unpinned; journal may be null
+  matching_shard(order_book &book, journal_writer *journal,
+                 std::vector<int> cpus);
+
+  // Queues a command, waiting for room if the shard is behind.
+  void submit(const shard_command &command);
+  // Waits until everything submitted so far has been executed.
+  void drain();
+  // Runs task on the shard thread, between two commands, and waits for it.
+  void call(const std::function<void()> &task);
+
+private:
+  static constexpr size_t QUEUE_CAPACITY = 1 << 14;
+
+  order_book &book;
+  journal_writer *journal;
+  mpsc_queue<shard_command> queue{QUEUE_CAPACITY};
+  // set by the shard just before it blocks on an empty queue
+  alignas(64) std::atomic<uint32_t> sleeping{0};
+  alignas(64) std::atomic<uint64_t> submitted{0};
+  alignas(64) std::atomic<uint64_t> executed{0};
+  std::thread thread;
+
+  void run(std::vector<int> cpus);
+  void execute(const shard_command &command);
+};
+
+// Shard that owns instr, out of shard_count
+inline size_t shard_of(const instrument &instr, size_t shard_count) {
+  return symbol_hash{}(instr.symbol) % shard_count;
+}
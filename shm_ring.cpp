@@ -0,0 +1,222 @@
+#include "shm_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// The ring is shared between processes, so these are the plain futex
+// operations rather than the _PRIVATE ones std::atomic::wait may use.
+void futex_wait(std::atomic<uint32_t> &word, uint32_t expected,
+                int timeout_ms) {
+  timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1'000'000L};
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT,
+          expected, &timeout, nullptr, 0);
+}
+
+void futex_wake(std::atomic<uint32_t> &word) {
+  syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE, INT_MAX,
+          nullptr, nullptr, 0);
+}
+
+size_t ring_size(uint32_t capacity) {
+  return sizeof(ring_header) + size_t{capacity} * sizeof(ClientCommand);
+}
+
+} // namespace
+
+command_ring::~command_ring() {
+  if (header) {
+    munmap(header, map_size);
+  }
+  if (memfd != -1) {
+    ::close(memfd);
+  }
+}
+
+bool command_ring::map(int fd, size_t size) {
+  // touch every page now rather than on the first commands
+  void *mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, 0);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+  header = static_cast<ring_header *>(mapped);
+  slots = reinterpret_cast<ClientCommand *>(static_cast<char *>(mapped) +
+                                            sizeof(ring_header));
+  map_size = size;
+  return true;
+}
+
+bool command_ring::create(uint32_t capacity) {
+  memfd = memfd_create("engine-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd == -1) {
+    return false;
+  }
+  size_t size = ring_size(capacity);
+  // the client gets the fd too; a shrunk file would fault our mapping
+  if (ftruncate(memfd, static_cast<off_t>(size)) == -1 ||
+      fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) ==
+          -1 ||
+      !map(memfd, size)) {
+    return false;
+  }
+  new (header) ring_header{};
+  header->magic = RING_MAGIC;
+  header->capacity = capacity;
+  this->capacity = capacity;
+  return true;
+}
+
+bool command_ring::attach(int fd) {
+  memfd = fd;
+  // magic and capacity, to know how much to map
+  uint32_t fields[2];
+  if (pread(fd, fields, sizeof(fields), 0) != sizeof(fields)) {
+    return false;
+  }
+  uint32_t capacity = fields[1];
+  if (fields[0] != RING_MAGIC || capacity == 0 ||
+      (capacity & (capacity - 1)) != 0) {
+    errno = EINVAL;
+    return false;
+  }
+  this->capacity = capacity;
+  return map(fd, ring_size(capacity));
+}
+
+bool command_ring::try_push(const ClientCommand &command) {
+  if (position - seen == capacity) {
+    seen = header->tail.load(std::memory_order_acquire);
+    if (position - seen == capacity) {
+      return false;
+    }
+  }
+  memcpy(&slots[position & (capacity - 1)], &command, sizeof(command));
+  position++;
+  header->head.store(position, std::memory_order_release);
+  wake();
+  return true;
+}
+
+void command_ring::close() {
+  header->closed.store(1, std::memory_order_release);
+  wake();
+}
+
+void command_ring::wake() {
+  // pairs with the fence in wait: either the engine sees what we published
+  // before it sleeps, or we see it asleep
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (header->sleeping.load(std::memory_order_relaxed)) {
+    header->sleeping.store(0, std::memory_order_relaxed);
+    futex_wake(header->sleeping);
+  }
+}
+
+std::span<const ClientCommand> command_ring::peek() {
+  uint64_t head = header->head.load(std::memory_order_acquire);
+  // also catches a head moved back behind what we have read
+  if (broken || head - position > capacity) {
+    broken = true;
+    return {};
+  }
+  // copy before anything looks at the commands, the client can still write
+  // the slots; the batch may wrap around the end of the ring
+  size_t count = std::min<uint64_t>(head - position, RING_BATCH);
+  size_t first = position & (capacity - 1);
+  size_t before_end = std::min<size_t>(count, capacity - first);
+  memcpy(copied, slots + first, before_end * sizeof(ClientCommand));
+  memcpy(copied + before_end, slots,
+         (count - before_end) * sizeof(ClientCommand));
+  return {copied, count};
+}
+
+void command_ring::consume(size_t n) {
+  position += n;
+  header->tail.store(position, std::memory_order_release);
+}
+
+bool command_ring::wait(int timeout_ms) {
+  // spin this many empty polls before sleeping
+  constexpr int SPIN_LIMIT = 4096;
+  auto ready = [&] {
+    return header->head.load(std::memory_order_acquire) != position ||
+           closed();
+  };
+  for (int i = 0; i < SPIN_LIMIT; i++) {
+    if (ready()) {
+      return true;
+    }
+  }
+
+  header->sleeping.store(1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (!ready()) {
+    futex_wait(header->sleeping, 1, timeout_ms);
+  }
+  header->sleeping.store(0, std::memory_order_relaxed);
+  return ready();
+}
+
+bool send_ring_fd(int socket, int fd) {
+  char byte = 0;
+  iovec iov{&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  while (true) {
+    ssize_t n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+    if (n == 1) {
+      return true;
+    }
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    return false;
+  }
+}
+
+int receive_ring_fd(int socket) {
+  char byte;
+  iovec iov{&byte, 1};
+  alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+  msghdr msg{};
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+  ssize_t n;
+  do {
+    n = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC);
+  } while (n == -1 && errno == EINTR);
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != 1 || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS) {
+    if (n >= 0) {
+      errno = EPROTO;
+    }
+    return -1;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
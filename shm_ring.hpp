@@ -0,0 +1,104 @@
+#pragma once
+
+#include "io.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Shared-memory command transport.
+//
+// A client that sends the ring handshake gets back, over its socket, a
+// memfd holding a single-producer single-consumer ring of ClientCommand
+// records. From then on it writes commands straight into the ring and the
+// engine copies them out in batches, with no syscall on either side while
+// the engine is polling. An idle engine sleeps on a futex in the shared page,
+// which the client wakes only when it sees the engine asleep. The socket
+// stays open just to tell each side when the other has gone away.
+//
+// The engine trusts nothing the client can write. It keeps the capacity it
+// created the ring with, closes the ring if the client moves head further
+// than that past what has been read, and seals the memfd so the client
+// cannot shrink it under the engine's mapping. Commands are copied out of
+// the shared slots before they are looked at, so a client rewriting a slot
+// can at worst make that copy garbage, never change it while it is used.
+
+constexpr uint32_t RING_MAGIC = 0x4d45524e; // "MERN"
+// ring size the engine hands out, in commands
+constexpr uint32_t RING_COMMANDS = 1 << 14;
+// most commands the engine copies out of the ring at once
+constexpr size_t RING_BATCH = 256;
+
+struct ring_header {
+  uint32_t magic;
+  // slots in the ring, a power of two
+  uint32_t capacity;
+  // next slot the client will write; only the client stores to it
+  alignas(64) std::atomic<uint64_t> head;
+  // futex word, 1 while the engine is (about to be) asleep
+  alignas(64) std::atomic<uint32_t> sleeping;
+  // set by the client after its last command
+  std::atomic<uint32_t> closed;
+  // next slot the engine will read; only the engine stores to it
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+static_assert(sizeof(ring_header) == 256);
+
+class command_ring {
+public:
+  command_ring() = default;
+  ~command_ring();
+  command_ring(const command_ring &) = delete;
+  command_ring &operator=(const command_ring &) = delete;
+
+  // Engine side: creates an empty ring of capacity slots (a power of two)
+  // in a new sealed memfd. Returns false with errno set on failure.
+  bool create(uint32_t capacity);
+  // Client side: maps a ring received from the engine.
+  bool attach(int fd);
+  int fd() const { return memfd; }
+
+  // Client side. Publishes one command, false if the ring is full.
+  bool try_push(const ClientCommand &command);
+  // Tells the engine no more commands are coming.
+  void close();
+
+  // Engine side. A private copy of the published commands not yet
+  // consumed, at most RING_BATCH of them; it stays valid until the next
+  // peek(). A head that claims more than the ring holds closes the ring
+  // instead.
+  std::span<const ClientCommand> peek();
+  void consume(size_t n);
+  bool closed() const {
+    return broken || header->closed.load(std::memory_order_acquire) != 0;
+  }
+  // whether the ring was closed because the client published a bad head
+  bool overrun() const { return broken; }
+  // Spins for a while, then sleeps until the client publishes or closes,
+  // or timeout_ms passes. Returns false if nothing happened.
+  bool wait(int timeout_ms);
+
+private:
+  ring_header *header = nullptr;
+  ClientCommand *slots = nullptr;
+  size_t map_size = 0;
+  int memfd = -1;
+  // as created or attached, never reread from the shared header
+  uint32_t capacity = 0;
+  bool broken = false;
+  // our own cursor, and the other side's as last loaded
+  uint64_t position = 0;
+  uint64_t seen = 0;
+  // engine side, what peek() hands out
+  ClientCommand copied[RING_BATCH];
+
+  bool map(int fd, size_t size);
+  void wake();
+};
+
+// Passes a ring's fd over a UNIX socket.
+bool send_ring_fd(int socket, int fd);
+// Receives the fd sent above, or -1.
+int receive_ring_fd(int socket);
@@ -0,0 +1,91 @@
+#include "snapshot.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+bool write_all(int fd, const void *data, size_t len) {
+  auto *p = static_cast<const char *>(data);
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += n;
+    len -= static_cast<size_t>(n);
+  }
+  return true;
+}
+
+} // namespace
+
+bool write_snapshot(const char *path, uint64_t instruments,
+                    std::span<const snapshot_order> orders) {
+  std::string temp = std::string(path) + ".tmp";
+  int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    return false;
+  }
+  snapshot_header header{};
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+  header.instruments = instruments;
+  header.orders = orders.size();
+  bool ok = write_all(fd, &header, sizeof(header)) &&
+            write_all(fd, orders.data(), orders.size_bytes()) &&
+            fsync(fd) == 0;
+  int saved = errno;
+  close(fd);
+  if (!ok || rename(temp.c_str(), path) != 0) {
+    saved = ok ? errno : saved;
+    unlink(temp.c_str());
+    errno = saved;
+    return false;
+  }
+  return true;
+}
+
+bool snapshot_reader::open(const char *path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd == -1) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return false;
+  }
+  auto size = static_cast<size_t>(st.st_size);
+  if (size < sizeof(snapshot_header)) {
+    close(fd);
+    errno = EINVAL;
+    return false;
+  }
+  void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapped == MAP_FAILED) {
+    return false;
+  }
+
+  auto *map = static_cast<const char *>(mapped);
+  snapshot_header header;
+  memcpy(&header, map, sizeof(header));
+  if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+      header.orders > (size - sizeof(header)) / sizeof(snapshot_order)) {
+    munmap(mapped, size);
+    errno = EINVAL;
+    return false;
+  }
+  first = reinterpret_cast<const snapshot_order *>(map + sizeof(header));
+  count = header.orders;
+  return true;
+}
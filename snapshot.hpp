@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+
+// Order book snapshots.
+//
+// A snapshot is a header followed by every resting order as a fixed-width
+// record. Each instrument's buys come first, then its sells, each side
+// best price first and in time priority within a price. Loading the
+// records back in file order rebuilds every queue exactly.
+
+constexpr char SNAPSHOT_MAGIC[8] = {'M', 'E', 'S', 'N', 'A', 'P', '1', 0};
+
+struct snapshot_header {
+  char magic[8];
+  uint64_t instruments;
+  uint64_t orders;
+  uint64_t reserved[5];
+};
+
+struct snapshot_order {
+  uint64_t symbol;
+  // when the order was added to the book, kept for priority
+  int64_t timestamp;
+  uint32_t id;
+  uint32_t price;
+  // remaining count
+  uint32_t count;
+  uint32_t execution_id;
+  uint8_t is_sell;
+  uint8_t reserved[7];
+};
+
+static_assert(sizeof(snapshot_header) == 64);
+static_assert(sizeof(snapshot_order) == 40);
+
+// Writes a snapshot next to path and renames it into place, so a reader
+// never sees half of one. Returns false with errno set on failure.
+bool write_snapshot(const char *path, uint64_t instruments,
+                    std::span<const snapshot_order> orders);
+
+class snapshot_reader {
+public:
+  // Maps a snapshot read-only. Returns false with errno set on failure,
+  // EINVAL if it is not a snapshot.
+  bool open(const char *path);
+  std::span<const snapshot_order> orders() const { return {first, count}; }
+
+private:
+  const snapshot_order *first = nullptr;
+  size_t count = 0;
+};
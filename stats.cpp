@@ -0,0 +1,134 @@
+#include "stats.hpp"
+
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+constexpr const char *STAGE_NAMES[STAGE_COUNT] = {
+    "read", "lookup", "lock_wait", "match", "output",
+};
+constexpr const char *COUNTER_NAMES[COUNTER_COUNT] = {
+    "orders",       "fills",  "cancels",        "rejects",
+    "mass_cancels", "amends", "lock_contended", "layout_switches",
+};
+
+// One thread's numbers. Only the thread holding the slot writes to it.
+struct thread_stats {
+  std::atomic<uint64_t> buckets[STAGE_COUNT][latency_histogram::BUCKETS];
+  std::atomic<uint64_t> max[STAGE_COUNT];
+  std::atomic<uint64_t> counters[COUNTER_COUNT];
+  uint64_t output_ns = 0;
+  // guarded by slots_mtx
+  bool in_use = false;
+};
+
+std::mutex slots_mtx;
+std::vector<thread_stats *> slots;
+
+// owner-only increment, no locked instruction needed
+void bump(std::atomic<uint64_t> &value, uint64_t n) {
+  value.store(value.load(std::memory_order_relaxed) + n,
+              std::memory_order_relaxed);
+}
+
+struct slot_handle {
+  thread_stats *slot = nullptr;
+
+  ~slot_handle() {
+    if (slot) {
+      std::scoped_lock<std::mutex> lock(slots_mtx);
+      slot->in_use = false;
+    }
+  }
+};
+
+thread_stats &local_slot() {
+  thread_local slot_handle handle;
+  if (!handle.slot) {
+    std::scoped_lock<std::mutex> lock(slots_mtx);
+    for (thread_stats *slot : slots) {
+      if (!slot->in_use) {
+        handle.slot = slot;
+        break;
+      }
+    }
+    if (!handle.slot) {
+      handle.slot = new thread_stats();
+      slots.push_back(handle.slot);
+    }
+    handle.slot->in_use = true;
+  }
+  return *handle.slot;
+}
+
+} // namespace
+
+void stats::record(stage s, uint64_t ns) {
+  thread_stats &slot = local_slot();
+  auto i = static_cast<size_t>(s);
+  bump(slot.buckets[i][latency_histogram::bucket_of(ns)], 1);
+  if (ns > slot.max[i].load(std::memory_order_relaxed)) {
+    slot.max[i].store(ns, std::memory_order_relaxed);
+  }
+}
+
+void stats::count(counter c, uint64_t n) {
+  if (enabled()) {
+    bump(local_slot().counters[static_cast<size_t>(c)], n);
+  }
+}
+
+uint64_t stats::output_time() { return local_slot().output_ns; }
+
+void stats::add_output_time(uint64_t ns) { local_slot().output_ns += ns; }
+
+void stats::dump(std::ostream &os) {
+  if (!enabled()) {
+    os << "stats are off, start the engine with --stats" << std::endl;
+    return;
+  }
+
+  latency_histogram stages[STAGE_COUNT];
+  uint64_t max[STAGE_COUNT] = {};
+  uint64_t counters[COUNTER_COUNT] = {};
+  size_t threads = 0;
+  {
+    std::scoped_lock<std::mutex> lock(slots_mtx);
+    threads = slots.size();
+    for (thread_stats *slot : slots) {
+      for (size_t s = 0; s < STAGE_COUNT; s++) {
+        for (size_t b = 0; b < latency_histogram::BUCKETS; b++) {
+          uint64_t n = slot->buckets[s][b].load(std::memory_order_relaxed);
+          if (n) {
+            stages[s].record(latency_histogram::upper_edge(b), n);
+          }
+        }
+        max[s] =
+            std::max(max[s], slot->max[s].load(std::memory_order_relaxed));
+      }
+      for (size_t c = 0; c < COUNTER_COUNT; c++) {
+        counters[c] += slot->counters[c].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  char line[160];
+  snprintf(line, sizeof(line), "%-10s %12s %9s %9s %9s %11s", "stage(ns)",
+           "count", "p50", "p99", "p99.9", "max");
+  os << "=== engine stats, " << threads << " thread slots ===\n"
+     << line << '\n';
+  for (size_t s = 0; s < STAGE_COUNT; s++) {
+    const latency_histogram &h = stages[s];
+    snprintf(line, sizeof(line), "%-10s %12lu %9lu %9lu %9lu %11lu",
+             STAGE_NAMES[s], h.count(), h.percentile(0.5), h.percentile(0.99),
+             h.percentile(0.999), max[s]);
+    os << line << '\n';
+  }
+  for (size_t c = 0; c < COUNTER_COUNT; c++) {
+    os << (c ? " " : "") << COUNTER_NAMES[c] << ' ' << counters[c];
+  }
+  os << '\n';
+  os.flush();
+}
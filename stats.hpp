@@ -0,0 +1,124 @@
+#pragma once
+
+#include "clock.hpp"
+#include "histogram.hpp"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+// Engine statistics, collected when --stats is given.
+//
+// Every thread records into its own slot of per-stage histograms and
+// counters. A slot has a single writer, so recording is a plain load and
+// store on relaxed atomics, and a dump can merge all slots at any time
+// without stopping anyone. Slots of exited threads are kept, and reused by
+// later threads, so totals cover the whole run.
+
+enum class stage : uint8_t {
+  // the read() syscall that fetched a batch of commands
+  read,
+  // finding the instrument for a new order
+  lookup,
+  // waiting for the instrument lock
+  lock_wait,
+  // matching and updating the book, less the output below
+  match,
+  // handing events to output, summed per command
+  output,
+};
+constexpr size_t STAGE_COUNT = 5;
+
+enum class counter : uint8_t {
+  orders,
+  fills,
+  cancels,
+  rejects,
+  mass_cancels,
+  amends,
+  // instrument locks that were already held when we asked
+  lock_contended,
+  // instruments rebuilt in the other book layout
+  layout_switches,
+};
+constexpr size_t COUNTER_COUNT = 8;
+
+class stats {
+public:
+  // Starts collecting. Call before any thread records.
+  static void enable() { active.store(true, std::memory_order_relaxed); }
+  static bool enabled() { return active.load(std::memory_order_relaxed); }
+
+  static void record(stage s, uint64_t ns);
+  static void count(counter c, uint64_t n = 1);
+
+  // Output time this thread has spent so far, for taking it back out of
+  // the match stage
+  static uint64_t output_time();
+  static void add_output_time(uint64_t ns);
+
+  // Merges every thread's slot and prints stage percentiles and counters.
+  static void dump(std::ostream &os);
+
+private:
+  static inline std::atomic<bool> active = false;
+};
+
+// Times a stage from construction to destruction, if stats are on
+class stage_timer {
+public:
+  explicit stage_timer(stage s)
+      : s(s), start(stats::enabled() ? tsc_clock::now() : -1) {}
+  ~stage_timer() {
+    if (start >= 0) {
+      stats::record(s, tsc_clock::now() - start);
+    }
+  }
+
+  stage_timer(const stage_timer &) = delete;
+  stage_timer &operator=(const stage_timer &) = delete;
+
+private:
+  stage s;
+  int64_t start;
+};
+
+// Adds the time of one output call to this thread's output total
+class output_timer {
+public:
+  output_timer() : start(stats::enabled() ? tsc_clock::now() : -1) {}
+  ~output_timer() {
+    if (start >= 0) {
+      stats::add_output_time(tsc_clock::now() - start);
+    }
+  }
+
+  output_timer(const output_timer &) = delete;
+  output_timer &operator=(const output_timer &) = delete;
+
+private:
+  int64_t start;
+};
+
+// Times one book operation, splitting it into the match and output stages
+class match_timer {
+public:
+  match_timer()
+      : start(stats::enabled() ? tsc_clock::now() : -1),
+        output_start(start >= 0 ? stats::output_time() : 0) {}
+  ~match_timer() {
+    if (start >= 0) {
+      uint64_t output = stats::output_time() - output_start;
+      uint64_t total = static_cast<uint64_t>(tsc_clock::now() - start);
+      stats::record(stage::match, total > output ? total - output : 0);
+      stats::record(stage::output, output);
+    }
+  }
+
+  match_timer(const match_timer &) = delete;
+  match_timer &operator=(const match_timer &) = delete;
+
+private:
+  int64_t start;
+  uint64_t output_start;
+};
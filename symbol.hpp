@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+// Instrument symbols are at most 8 characters, so they are interned by
+// packing their bytes (NUL padded) into a single 64-bit key.
+constexpr size_t SYMBOL_LENGTH = 8;
+
+inline uint64_t pack_symbol(const char *symbol) {
+  uint64_t key = 0;
+  memcpy(&key, symbol, strnlen(symbol, SYMBOL_LENGTH));
+  return key;
+}
+
+inline uint64_t pack_symbol(std::string_view symbol) {
+  uint64_t key = 0;
+  memcpy(&key, symbol.data(), std::min(symbol.size(), SYMBOL_LENGTH));
+  return key;
+}
+
+// view of the characters of a packed key, which must outlive the view
+inline std::string_view symbol_view(const uint64_t &key) {
+  const char *chars = reinterpret_cast<const char *>(&key);
+  return {chars, strnlen(chars, SYMBOL_LENGTH)};
+}
+
+// packed symbols differ mostly in their low bytes, spread them over the word
+struct symbol_hash {
+  size_t operator()(uint64_t key) const {
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+  }
+};